@@ -0,0 +1,25 @@
+#!/bin/bash
+# Time the benchmarks under the tree-walker, the switch dispatch loop and the
+# threaded dispatch loop, all built with the same optimisation flags.
+set -e
+
+cd "$(dirname "$0")/.."
+CXX=${CXX:-c++}
+BENCH_CXXFLAGS=${BENCH_CXXFLAGS:--O2}
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+cp core.forth "$out/"
+$CXX -std=c++20 $BENCH_CXXFLAGS src/*.cc -o "$out/stacker-switch"
+$CXX -std=c++20 $BENCH_CXXFLAGS -DSTACKER_THREADED src/*.cc \
+  -o "$out/stacker-threaded"
+
+TIMEFORMAT=%R
+printf '%-20s %10s %10s %10s\n' benchmark tree switch threaded
+for bench in bench/*.forth; do
+  tree=$( { time "$out/stacker-switch" --tree interp "$bench" >/dev/null; } 2>&1)
+  switch=$( { time "$out/stacker-switch" interp "$bench" >/dev/null; } 2>&1)
+  threaded=$( { time "$out/stacker-threaded" interp "$bench" >/dev/null; } 2>&1)
+  printf '%-20s %10s %10s %10s\n' "$(basename "$bench" .forth)" \
+    "$tree" "$switch" "$threaded"
+done
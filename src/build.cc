@@ -0,0 +1,126 @@
+#include "build.hh"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+#include "compiler.hh"
+#include "file.hh"
+#include "hash.hh"
+#include "lexer.hh"
+
+const MappedFile &checkOpen(const MappedFile &file,
+                           const std::filesystem::path &path);
+void hashField(std::uint64_t &hash, std::string_view data);
+std::filesystem::path cacheDirectory();
+std::string quote(const std::string &argument);
+
+const MappedFile &checkOpen(const MappedFile &file,
+                           const std::filesystem::path &path) {
+  if (!file.isOpen()) {
+    std::cerr << __FILE__ << ":" << __LINE__ << path
+              << ": : No such file or directory\n";
+    exit(EXIT_FAILURE);
+  }
+  return file;
+}
+
+// Hashes the length first so that consecutive fields cannot run together.
+void hashField(std::uint64_t &hash, std::string_view data) {
+  hash = fnv1a(std::to_string(data.size()) + ":", hash);
+  hash = fnv1a(data, hash);
+}
+
+std::filesystem::path cacheDirectory() {
+  if (const char *cache = std::getenv("XDG_CACHE_HOME"); cache && *cache) {
+    return std::filesystem::path(cache) / "stacker";
+  }
+  if (const char *home = std::getenv("HOME"); home && *home) {
+    return std::filesystem::path(home) / ".cache" / "stacker";
+  }
+  return std::filesystem::temp_directory_path() / "stacker";
+}
+
+std::string quote(const std::string &argument) {
+  std::string quoted = "'";
+  for (const char c : argument) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+}
+
+std::filesystem::path build(const std::filesystem::path &corePath,
+                            const std::filesystem::path &sourcePath,
+                            const Compiler::Options &options) {
+  const char *cxx = std::getenv("CXX");
+  const char *cxxFlags = std::getenv("CXXFLAGS");
+  const std::string command =
+      std::string(cxx && *cxx ? cxx : "c++") +
+      " -std=c++20 -O3 -march=native -flto " + (cxxFlags ? cxxFlags : "");
+
+  const MappedFile coreFile{corePath};
+  const MappedFile sourceFile{sourcePath};
+  const std::string_view core = checkOpen(coreFile, corePath).contents();
+  const std::string_view source = checkOpen(sourceFile, sourcePath).contents();
+
+  std::uint64_t hash = FNV1A_BASIS;
+  hashField(hash, std::to_string(executableId()));
+  hashField(hash, command);
+  hashField(hash, std::to_string(options.inlining) + " " +
+                  std::to_string(options.stackSize) + " " +
+                  std::to_string(options.outputBuffer));
+  hashField(hash, core);
+  hashField(hash, source);
+
+  char name[17];
+  std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+
+  const std::filesystem::path directory = cacheDirectory();
+  const std::filesystem::path binaryPath = directory / name;
+  if (std::filesystem::exists(binaryPath)) {
+    return binaryPath;
+  }
+  std::filesystem::create_directories(directory);
+
+  Compiler compiler{options};
+  Lexer coreLexer{core};
+  compiler.compile(coreLexer);
+  Lexer sourceLexer{source};
+  compiler.compile(sourceLexer);
+
+  // Concurrent builds of the same program each write their own files and
+  // the last rename wins.
+  const std::string unique = "." + std::to_string(getpid());
+  std::filesystem::path generatedPath = binaryPath;
+  generatedPath.concat(unique + ".cc");
+  std::filesystem::path temporaryPath = binaryPath;
+  temporaryPath.concat(unique);
+
+  std::ofstream generated{generatedPath};
+  compiler.write(generated);
+  generated.close();
+
+  const int status = std::system((command + " -o " +
+                                  quote(temporaryPath.string()) + " " +
+                                  quote(generatedPath.string()))
+                                     .c_str());
+  std::filesystem::remove(generatedPath);
+  if (status != 0) {
+    std::filesystem::remove(temporaryPath);
+    std::cerr << __FILE__ << ":" << __LINE__ << ": " << command
+              << " failed\n";
+    exit(EXIT_FAILURE);
+  }
+  std::filesystem::rename(temporaryPath, binaryPath);
+  return binaryPath;
+}
@@ -0,0 +1,17 @@
+#ifndef BUILD_HH
+#define BUILD_HH
+
+#include <filesystem>
+
+#include "compiler.hh"
+
+// Returns the path of an executable compiled from core and source with the
+// given options. Executables are cached under $XDG_CACHE_HOME/stacker, keyed
+// on a hash of both files, the options, the C++ compiler command and the
+// stacker executable that generated the C++, so a cache hit costs only
+// reading the two files.
+std::filesystem::path build(const std::filesystem::path &corePath,
+                            const std::filesystem::path &sourcePath,
+                            const Compiler::Options &options);
+
+#endif // BUILD_HH
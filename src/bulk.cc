@@ -0,0 +1,180 @@
+#include "bulk.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BULK_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+void fillScalar(std::uint8_t *destination, std::size_t length,
+                std::uint8_t byte) {
+  for (std::size_t i = 0; i < length; ++i) {
+    destination[i] = byte;
+  }
+}
+
+std::size_t scanScalar(const std::uint8_t *addr, std::size_t length,
+                       std::uint8_t byte) {
+  std::size_t i = 0;
+  while (i < length && addr[i] != byte) {
+    ++i;
+  }
+  return i;
+}
+
+std::size_t mismatchScalar(const std::uint8_t *a, const std::uint8_t *b,
+                           std::size_t length) {
+  std::size_t i = 0;
+  while (i < length && a[i] == b[i]) {
+    ++i;
+  }
+  return i;
+}
+
+#ifdef BULK_X86
+
+// SSE2 is part of x86-64, so these need no check. Each handles whole
+// vectors and leaves the tail to the scalar loop.
+
+void fillSse2(std::uint8_t *destination, std::size_t length,
+              std::uint8_t byte) {
+  const __m128i fill = _mm_set1_epi8(char(byte));
+  std::size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(destination + i), fill);
+  }
+  fillScalar(destination + i, length - i, byte);
+}
+
+std::size_t scanSse2(const std::uint8_t *addr, std::size_t length,
+                     std::uint8_t byte) {
+  const __m128i needle = _mm_set1_epi8(char(byte));
+  std::size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    const __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(addr + i));
+    const unsigned found =
+        unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+    if (found) {
+      return i + std::size_t(std::countr_zero(found));
+    }
+  }
+  return i + scanScalar(addr + i, length - i, byte);
+}
+
+std::size_t mismatchSse2(const std::uint8_t *a, const std::uint8_t *b,
+                         std::size_t length) {
+  std::size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    const __m128i blockA =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    const __m128i blockB =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+    const unsigned differ =
+        ~unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(blockA, blockB))) & 0xffff;
+    if (differ) {
+      return i + std::size_t(std::countr_zero(differ));
+    }
+  }
+  return i + mismatchScalar(a + i, b + i, length - i);
+}
+
+[[gnu::target("avx2")]] void fillAvx2(std::uint8_t *destination,
+                                      std::size_t length, std::uint8_t byte) {
+  const __m256i fill = _mm256_set1_epi8(char(byte));
+  std::size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(destination + i), fill);
+  }
+  fillSse2(destination + i, length - i, byte);
+}
+
+[[gnu::target("avx2")]] std::size_t
+scanAvx2(const std::uint8_t *addr, std::size_t length, std::uint8_t byte) {
+  const __m256i needle = _mm256_set1_epi8(char(byte));
+  std::size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    const __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(addr + i));
+    const unsigned found =
+        unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+    if (found) {
+      return i + std::size_t(std::countr_zero(found));
+    }
+  }
+  return i + scanSse2(addr + i, length - i, byte);
+}
+
+[[gnu::target("avx2")]] std::size_t
+mismatchAvx2(const std::uint8_t *a, const std::uint8_t *b, std::size_t length) {
+  std::size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    const __m256i blockA =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+    const __m256i blockB =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    const unsigned differ =
+        ~unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(blockA, blockB)));
+    if (differ) {
+      return i + std::size_t(std::countr_zero(differ));
+    }
+  }
+  return i + mismatchSse2(a + i, b + i, length - i);
+}
+
+#endif
+
+struct Kernels {
+  void (*fill)(std::uint8_t *, std::size_t, std::uint8_t);
+  std::size_t (*scan)(const std::uint8_t *, std::size_t, std::uint8_t);
+  std::size_t (*mismatch)(const std::uint8_t *, const std::uint8_t *,
+                          std::size_t);
+};
+
+Kernels selectKernels() {
+#ifdef BULK_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return {fillAvx2, scanAvx2, mismatchAvx2};
+  }
+  return {fillSse2, scanSse2, mismatchSse2};
+#else
+  return {fillScalar, scanScalar, mismatchScalar};
+#endif
+}
+
+const Kernels kernels = selectKernels();
+
+} // namespace
+
+// libc's memmove already picks a vectorized copy for the CPU and handles
+// overlap, so move goes straight to it.
+void bulkMove(std::uint8_t *destination, const std::uint8_t *source,
+              std::size_t length) {
+  std::memmove(destination, source, length);
+}
+
+void bulkFill(std::uint8_t *destination, std::size_t length,
+              std::uint8_t byte) {
+  kernels.fill(destination, length, byte);
+}
+
+std::int64_t bulkCompare(const std::uint8_t *a, std::size_t aLength,
+                         const std::uint8_t *b, std::size_t bLength) {
+  const std::size_t length = std::min(aLength, bLength);
+  const std::size_t mismatch = kernels.mismatch(a, b, length);
+  if (mismatch < length) {
+    return a[mismatch] < b[mismatch] ? -1 : 1;
+  }
+  return aLength < bLength ? -1 : aLength > bLength ? 1 : 0;
+}
+
+std::size_t bulkScan(const std::uint8_t *addr, std::size_t length,
+                     std::uint8_t byte) {
+  return kernels.scan(addr, length, byte);
+}
@@ -0,0 +1,20 @@
+#ifndef BULK_HH
+#define BULK_HH
+
+#include <cstddef>
+#include <cstdint>
+
+// Kernels behind move, fill, compare and scan. On x86-64 they use AVX2 when
+// the CPU has it and SSE2 otherwise; elsewhere they are plain loops.
+
+void bulkMove(std::uint8_t *destination, const std::uint8_t *source,
+              std::size_t length);
+void bulkFill(std::uint8_t *destination, std::size_t length, std::uint8_t byte);
+// -1, 0 or 1 as a is lexicographically less than, equal to or greater than b.
+std::int64_t bulkCompare(const std::uint8_t *a, std::size_t aLength,
+                         const std::uint8_t *b, std::size_t bLength);
+// Index of the first byte in addr equal to byte, or length if there is none.
+std::size_t bulkScan(const std::uint8_t *addr, std::size_t length,
+                     std::uint8_t byte);
+
+#endif // BULK_HH
@@ -1,62 +1,303 @@
 #include "compiler.hh"
 
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <optional>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "optimizer.hh"
 #include "parser.hh"
 
+std::string cppLiteral(const std::string &str);
+
+// A C++ string literal with the bytes of str. Anything but printable ASCII
+// is written as a three-digit octal escape, which cannot run into the next
+// character the way a hex escape can.
+std::string cppLiteral(const std::string &str) {
+  static constexpr char DIGITS[] = "01234567";
+  std::string result = "\"";
+  for (const char ch : str) {
+    const unsigned char byte = static_cast<unsigned char>(ch);
+    if (ch == '"' || ch == '\\') {
+      result += '\\';
+      result += ch;
+    } else if (byte >= ' ' && byte <= '~') {
+      result += ch;
+    } else {
+      result += '\\';
+      result += DIGITS[byte >> 6];
+      result += DIGITS[byte >> 3 & 7];
+      result += DIGITS[byte & 7];
+    }
+  }
+  return result + "\"";
+}
+
+Compiler::Compiler() : Compiler(Options()) {}
+
+Compiler::Compiler(const Options &options) : options(options) {}
+
 void Compiler::compileBody(const std::vector<Expression> &body,
-                           std::string &destination) {
-  for (const Expression &expr : body) {
-    compileExpression(expr, destination);
+                           std::string &destination, bool tail) {
+  for (std::size_t i = 0; i < body.size(); ++i) {
+    compileExpression(body[i], destination, tail && i + 1 == body.size());
   }
 }
 
-void Compiler::compile(std::istream &source) {
+void Compiler::compile(Lexer &source) {
   std::optional<Expression> expression;
   while ((expression = parse(source))) {
-    compileExpression(*expression, mainSection);
+    if (options.inlining) {
+      inlineCalls(*expression,
+                  [this](const std::string &word)
+                      -> const std::vector<Expression> * {
+                    const auto &find = dictionary.find(word);
+                    if (find == dictionary.end()) {
+                      return nullptr;
+                    }
+                    return &find->second.definition.body;
+                  });
+    }
+    fuse(*expression);
+    defineNested(*expression);
+    if (expression->type == Expression::Type::WordDefinition) {
+      define(std::move(std::get<Expression::WordDefinition>(expression->data)));
+    } else {
+      mainBody.push_back(std::move(*expression));
+    }
   }
 }
 
-void Compiler::compileExpression(const Expression &expression,
+void Compiler::define(Expression::WordDefinition definition) {
+  if (dictionary.contains(definition.word)) {
+    std::cerr << __FILE__ << ":" << __LINE__
+              << ": word already defined: " << definition.word << "\n";
+    exit(EXIT_FAILURE);
+  }
+
+  const std::string word = definition.word;
+  dictionary[word] = {nextDictionaryName, std::move(definition)};
+  ++nextDictionaryName;
+}
+
+// Definitions inside control structures or other definitions are entered
+// into the dictionary up front, so write sees them before it decides which
+// words to declare.
+void Compiler::defineNested(const Expression &expression) {
+  switch (expression.type) {
+  case Expression::Type::WordDefinition:
+    defineNestedBody(
+        std::get<Expression::WordDefinition>(expression.data).body);
+    break;
+  case Expression::Type::IfThen:
+  case Expression::Type::BeginUntil:
+  case Expression::Type::BeginAgain:
+  case Expression::Type::DoLoop:
+  case Expression::Type::DoPlusLoop:
+    defineNestedBody(std::get<std::vector<Expression>>(expression.data));
+    break;
+  case Expression::Type::IfElseThen: {
+    const Expression::IfElse &ifElse =
+        std::get<Expression::IfElse>(expression.data);
+    defineNestedBody(ifElse.ifBody);
+    defineNestedBody(ifElse.elseBody);
+  } break;
+  case Expression::Type::BeginWhileRepeat: {
+    const Expression::BeginWhile &beginWhile =
+        std::get<Expression::BeginWhile>(expression.data);
+    defineNestedBody(beginWhile.condBody);
+    defineNestedBody(beginWhile.whileBody);
+  } break;
+  default:
+    break;
+  }
+}
+
+void Compiler::defineNestedBody(const std::vector<Expression> &body) {
+  for (const Expression &expression : body) {
+    if (expression.type == Expression::Type::WordDefinition) {
+      define(std::get<Expression::WordDefinition>(expression.data));
+    }
+    defineNested(expression);
+  }
+}
+
+void Compiler::countCalls(const std::vector<Expression> &body,
+                          std::map<std::string, int> &calls) {
+  for (const Expression &expression : body) {
+    switch (expression.type) {
+    case Expression::Type::Word:
+      ++calls[std::get<std::string>(expression.data)];
+      break;
+    case Expression::Type::IfThen:
+    case Expression::Type::BeginUntil:
+    case Expression::Type::BeginAgain:
+    case Expression::Type::DoLoop:
+    case Expression::Type::DoPlusLoop:
+      countCalls(std::get<std::vector<Expression>>(expression.data), calls);
+      break;
+    case Expression::Type::IfElseThen: {
+      const Expression::IfElse &ifElse =
+          std::get<Expression::IfElse>(expression.data);
+      countCalls(ifElse.ifBody, calls);
+      countCalls(ifElse.elseBody, calls);
+    } break;
+    case Expression::Type::BeginWhileRepeat: {
+      const Expression::BeginWhile &beginWhile =
+          std::get<Expression::BeginWhile>(expression.data);
+      countCalls(beginWhile.condBody, calls);
+      countCalls(beginWhile.whileBody, calls);
+    } break;
+    case Expression::Type::WordDefinition:
+      countCalls(std::get<Expression::WordDefinition>(expression.data).body,
+                 calls);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+bool Compiler::reaches(const std::string &from, const std::string &to) {
+  std::set<std::string> seen;
+  std::vector<std::string> pending{from};
+  while (!pending.empty()) {
+    const auto &find = dictionary.find(pending.back());
+    pending.pop_back();
+    if (find == dictionary.end()) {
+      continue;
+    }
+    std::map<std::string, int> calls;
+    countCalls(find->second.definition.body, calls);
+    for (const auto &[word, count] : calls) {
+      if (word == to) {
+        return true;
+      }
+      if (seen.insert(word).second) {
+        pending.push_back(word);
+      }
+    }
+  }
+  return false;
+}
+
+std::string Compiler::literal(std::int64_t number) {
+  if (number == std::numeric_limits<std::int64_t>::min()) {
+    return "(-" + std::to_string(std::numeric_limits<std::int64_t>::max()) +
+           " - 1)";
+  }
+  return "std::int64_t(" + std::to_string(number) + ")";
+}
+
+std::string Compiler::bindValue(const std::string &value,
+                                std::string &destination) {
+  const std::string name = "v" + std::to_string(nextLocal++);
+  destination +=
+      "[[maybe_unused]] const std::int64_t " + name + " = " + value + ";\n";
+  return name;
+}
+
+void Compiler::pushValue(const std::string &value) {
+  values.push_back(value);
+}
+
+std::string Compiler::popValue(std::string &destination) {
+  if (values.empty()) {
+    return bindValue("parameterStack.pop()", destination);
+  }
+  std::string value = std::move(values.back());
+  values.pop_back();
+  return value;
+}
+
+void Compiler::dropValue(std::string &destination) {
+  if (values.empty()) {
+    destination += "parameterStack.pop();\n";
+  } else {
+    values.pop_back();
+  }
+}
+
+void Compiler::flushValues(std::string &destination) {
+  for (const std::string &value : values) {
+    destination += "parameterStack.push(" + value + ");\n";
+  }
+  values.clear();
+}
+
+void Compiler::compileBinary(const std::string &name, const std::string &op,
+                             std::string &destination) {
+  destination += "// " + name + "\n";
+  const std::string b = popValue(destination);
+  const std::string a = popValue(destination);
+  pushValue(bindValue(a + " " + op + " " + b, destination));
+}
+
+void Compiler::compileComparison(const std::string &name,
+                                 const std::string &op,
                                  std::string &destination) {
+  destination += "// " + name + "\n";
+  const std::string b = popValue(destination);
+  const std::string a = popValue(destination);
+  pushValue(
+      bindValue("boolToInt64(" + a + " " + op + " " + b + ")", destination));
+}
+
+// Values stay in the compiler's model of the stack, as literals or named
+// locals, for as long as the code is straight-line. They are only pushed to
+// the runtime parameterStack before a call or a change in control flow, or
+// popped from it when the model runs dry.
+void Compiler::compileExpression(const Expression &expression,
+                                 std::string &destination, bool tail) {
   switch (expression.type) {
 
   case Expression::Type::Number:
-    destination += "// Number\n"
-                   "parameterStack.push(" +
-                   std::to_string(std::get<std::int64_t>(expression.data)) +
-                   ");\n";
+    pushValue(literal(std::get<std::int64_t>(expression.data)));
     break;
   case Expression::Type::String: {
     const std::string &str = std::get<std::string>(expression.data);
-    destination += "// String\n"
-                   "{\n"
-                   "std::uint8_t *const addr = new std::uint8_t[" +
-                   std::to_string(str.size()) + "];\n";
-    for (std::size_t i = 0; i < str.size(); ++i) {
-      destination += "addr[" + std::to_string(i) +
-                     "] = " + std::to_string(int(str[i])) + ";\n";
+    auto find = literals.find(str);
+    if (find == literals.end()) {
+      find = literals
+                 .emplace(str, "literal_" + std::to_string(literals.size()))
+                 .first;
     }
-    destination +=
-        "parameterStack.push(reinterpret_cast<std::int64_t>(addr));\n"
-        "parameterStack.push(" +
-        std::to_string(str.size()) +
-        ");\n"
-        "}\n";
+    destination += "// String\n";
+    pushValue(bindValue("reinterpret_cast<std::int64_t>(" + find->second + ")",
+                        destination));
+    pushValue(literal(std::int64_t(str.size())));
   } break;
   case Expression::Type::Word: {
     const std::string &word = std::get<std::string>(expression.data);
     const auto &find = dictionary.find(word);
-    const int name = find->second.name;
-    if (find != dictionary.end()) {
+    if (splicedWords.contains(word)) {
+      destination += "// Splice " + word + "\n";
+      compileBody(find->second.definition.body, destination, tail);
+    } else if (find != dictionary.end() && tail &&
+        find->second.name == currentWord) {
+      flushValues(destination);
+      destination += "// Word " + word +
+                     "\n"
+                     "goto start;\n";
+      tailRecursive = true;
+    } else if (find != dictionary.end() && tail) {
+      flushValues(destination);
       destination += "// Word " + word +
                      "\n"
-                     "word_" +
-                     std::to_string(name) + "();\n";
+                     "return {word_" +
+                     std::to_string(find->second.name) + "};\n";
+    } else if (find != dictionary.end()) {
+      flushValues(destination);
+      destination += "// Word " + word +
+                     "\n"
+                     "call(word_" +
+                     std::to_string(find->second.name) + "());\n";
     } else {
       std::cerr << __FILE__ << ":" << __LINE__ << ": unknown word: " << word
                 << "\n";
@@ -65,222 +306,252 @@ void Compiler::compileExpression(const Expression &expression,
   } break;
 
   case Expression::Type::Add:
-    destination += "// Add\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(a + b);\n"
-                   "}\n";
+    compileBinary("Add", "+", destination);
     break;
   case Expression::Type::Sub:
-    destination += "// Sub\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(a - b);\n"
-                   "}\n";
+    compileBinary("Sub", "-", destination);
     break;
   case Expression::Type::Mul:
-    destination += "// Mul\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(a * b);\n"
-                   "}\n";
+    compileBinary("Mul", "*", destination);
     break;
   case Expression::Type::Div:
-    destination += "// Div\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(a / b);\n"
-                   "}\n";
+    compileBinary("Div", "/", destination);
     break;
   case Expression::Type::Rem:
-    destination += "// Rem\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(a % b);\n"
-                   "}\n";
-    break;
-  case Expression::Type::Mod:
-    destination += "// Mod\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push((a % b + b) % b);\n"
-                   "}\n";
+    compileBinary("Rem", "%", destination);
     break;
+  case Expression::Type::Mod: {
+    destination += "// Mod\n";
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    pushValue(bindValue("(" + a + " % " + b + " + " + b + ") % " + b,
+                        destination));
+  } break;
 
   case Expression::Type::More:
-    destination += "// More\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(boolToInt64(a > b));\n"
-                   "}\n";
+    compileComparison("More", ">", destination);
     break;
   case Expression::Type::Less:
-    destination += "// Less\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(boolToInt64(a < b));\n"
-                   "}\n";
+    compileComparison("Less", "<", destination);
     break;
   case Expression::Type::Equal:
-    destination += "// Equals\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(boolToInt64(a == b));\n"
-                   "}\n";
+    compileComparison("Equals", "==", destination);
     break;
   case Expression::Type::NotEqual:
-    destination += "// NotEquals\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(boolToInt64(a != b));\n"
-                   "}\n";
+    compileComparison("NotEquals", "!=", destination);
     break;
 
   case Expression::Type::And:
-    destination += "// And\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(a & b);\n"
-                   "}\n";
+    compileBinary("And", "&", destination);
     break;
   case Expression::Type::Or:
-    destination += "// Or\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(a | b);\n"
-                   "}\n";
+    compileBinary("Or", "|", destination);
     break;
   case Expression::Type::Inv:
-    destination += "// Inverse\n"
-                   "parameterStack.push(~parameterStack.pop());\n";
+    destination += "// Inverse\n";
+    pushValue(bindValue("~" + popValue(destination), destination));
     break;
 
   case Expression::Type::Emit:
-    destination += "// Emit\n"
-                   "std::cout.put(char(parameterStack.pop()));\n";
+    destination += "// Emit\n";
+    destination += "std::putc(int(" + popValue(destination) + "), stdout);\n";
     break;
   case Expression::Type::Key:
     destination += "// Key\n"
-                   "parameterStack.push(std::cin.get());\n";
+                   "std::fflush(stdout);\n";
+    pushValue(bindValue("std::cin.get()", destination));
     break;
-
-  case Expression::Type::Dup:
-    destination += "// Dup\n"
-                   "{\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(a);\n"
-                   "parameterStack.push(a);\n"
-                   "}\n";
-    break;
-  case Expression::Type::Drop:
-    destination += "// Drop\n"
-                   "parameterStack.pop();\n";
-    break;
-  case Expression::Type::Swap:
-    destination += "// Swap\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(b);\n"
-                   "parameterStack.push(a);\n"
+  case Expression::Type::Type: {
+    destination += "// Type\n";
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    destination += "if (" + b + " > 0) {\n"
+                   "std::fwrite(reinterpret_cast<const char *>(" + a +
+                   "), 1, std::size_t(" + b + "), stdout);\n"
                    "}\n";
+  } break;
+  case Expression::Type::Flush:
+    destination += "// Flush\n"
+                   "std::fflush(stdout);\n";
     break;
-  case Expression::Type::Over:
-    destination += "// Over\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(a);\n"
-                   "parameterStack.push(b);\n"
-                   "parameterStack.push(a);\n"
-                   "}\n";
+  case Expression::Type::Accept: {
+    destination += "// Accept\n";
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    pushValue(bindValue("acceptLine(" + a + ", " + b + ")", destination));
+  } break;
+  case Expression::Type::ReadLine:
+    flushValues(destination);
+    destination += "// ReadLine\n"
+                   "readLine();\n";
     break;
-  case Expression::Type::Rot:
-    destination += "// Rot\n"
-                   "{\n"
-                   "const std::int64_t c = parameterStack.pop();\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "parameterStack.push(b);\n"
-                   "parameterStack.push(c);\n"
-                   "parameterStack.push(a);\n"
-                   "}\n";
+  case Expression::Type::Slurp: {
+    destination += "// Slurp\n";
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    flushValues(destination);
+    destination += "slurp(" + a + ", " + b + ");\n";
+  } break;
+
+  case Expression::Type::Dup: {
+    const std::string a = popValue(destination);
+    pushValue(a);
+    pushValue(a);
+  } break;
+  case Expression::Type::Drop:
+    dropValue(destination);
     break;
+  case Expression::Type::Swap: {
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    pushValue(b);
+    pushValue(a);
+  } break;
+  case Expression::Type::Over: {
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    pushValue(a);
+    pushValue(b);
+    pushValue(a);
+  } break;
+  case Expression::Type::Rot: {
+    const std::string c = popValue(destination);
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    pushValue(b);
+    pushValue(c);
+    pushValue(a);
+  } break;
 
   case Expression::Type::ToR:
-    destination += "// ToR\n"
-                   "returnStack.push(parameterStack.pop());\n";
+    destination += "// ToR\n";
+    destination += "returnStack.push(" + popValue(destination) + ");\n";
     break;
   case Expression::Type::RFrom:
-    destination += "// RFrom\n"
-                   "parameterStack.push(returnStack.pop());\n";
+    destination += "// RFrom\n";
+    pushValue(bindValue("returnStack.pop()", destination));
     break;
-  case Expression::Type::RFetch:
-    destination += "// RFetch\n"
-                   "{\n"
-                   "const std::int64_t a = returnStack.pop();\n"
-                   "returnStack.push(a);\n"
-                   "parameterStack.push(a);\n"
-                   "}\n";
+  case Expression::Type::RFetch: {
+    destination += "// RFetch\n";
+    const std::string a = bindValue("returnStack.pop()", destination);
+    destination += "returnStack.push(" + a + ");\n";
+    pushValue(a);
+  } break;
+  case Expression::Type::I:
+    pushValue(loops.back().index);
     break;
-
-  case Expression::Type::Store:
-    destination += "// Store\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "*reinterpret_cast<std::int64_t *>(b) = a;\n"
-                   "}\n";
+  case Expression::Type::J:
+    pushValue(loops[loops.size() - 2].index);
     break;
-  case Expression::Type::Fetch:
+
+  case Expression::Type::Store: {
+    destination += "// Store\n";
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
     destination +=
-        "// Fetch\n"
-        "parameterStack.push(\n"
-        "*reinterpret_cast<std::int64_t *>(parameterStack.pop()));\n";
-    break;
-  case Expression::Type::CStore:
-    destination += "// CStore\n"
-                   "{\n"
-                   "const std::int64_t b = parameterStack.pop();\n"
-                   "const std::int64_t a = parameterStack.pop();\n"
-                   "*reinterpret_cast<char *>(b) = char(a);\n"
-                   "}\n";
+        "*reinterpret_cast<std::int64_t *>(" + b + ") = " + a + ";\n";
+  } break;
+  case Expression::Type::Fetch:
+    destination += "// Fetch\n";
+    pushValue(bindValue("*reinterpret_cast<std::int64_t *>(" +
+                            popValue(destination) + ")",
+                        destination));
     break;
+  case Expression::Type::CStore: {
+    destination += "// CStore\n";
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    destination +=
+        "*reinterpret_cast<char *>(" + b + ") = char(" + a + ");\n";
+  } break;
   case Expression::Type::CFetch:
-    destination += "// CFetch\n"
-                   "parameterStack.push(*reinterpret_cast<char *>("
-                   "parameterStack.pop()"
-                   "));\n";
+    destination += "// CFetch\n";
+    pushValue(bindValue(
+        "*reinterpret_cast<char *>(" + popValue(destination) + ")",
+        destination));
     break;
   case Expression::Type::Alloc:
-    destination +=
-        "// Alloc\n"
-        "{\n"
-        "const std::int64_t size = parameterStack.pop();\n"
-        "std::uint8_t *const addr = new std::uint8_t[size];\n"
-        "parameterStack.push(reinterpret_cast<std::int64_t>(addr));\n"
-        "}\n";
+    destination += "// Alloc\n";
+    pushValue(bindValue("reinterpret_cast<std::int64_t>(new std::uint8_t[" +
+                            popValue(destination) + "])",
+                        destination));
     break;
   case Expression::Type::Free:
-    destination += "// Free\n"
-                  "{\n"
-                  "std::uint8_t *const addr =\n"
-                  "reinterpret_cast<std::uint8_t *>(parameterStack.pop());\n"
-                  "delete[] addr;\n"
-                  "}\n";
+    destination += "// Free\n";
+    destination += "delete[] reinterpret_cast<std::uint8_t *>(" +
+                   popValue(destination) + ");\n";
+    break;
+  case Expression::Type::RegionAlloc:
+    destination += "// RegionAlloc\n";
+    pushValue(bindValue("reinterpret_cast<std::int64_t>(region.allocate(" +
+                            popValue(destination) + "))",
+                        destination));
+    break;
+  case Expression::Type::RegionMark:
+    destination += "// RegionMark\n";
+    pushValue(bindValue("region.mark()", destination));
     break;
+  case Expression::Type::RegionRelease:
+    destination += "// RegionRelease\n";
+    destination += "region.release(" + popValue(destination) + ");\n";
+    break;
+  case Expression::Type::Strdup: {
+    destination += "// Strdup\n";
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    const std::string copy = "s" + std::to_string(nextLocal++);
+    destination += "std::uint8_t *const " + copy + " = new std::uint8_t[" +
+                   b + " > 0 ? " + b + " : 1];\n"
+                   "std::memcpy(" + copy +
+                   ", reinterpret_cast<const void *>(" + a + "), " + b +
+                   " > 0 ? " + b + " : 0);\n";
+    pushValue(bindValue("reinterpret_cast<std::int64_t>(" + copy + ")",
+                        destination));
+    pushValue(b);
+  } break;
+  case Expression::Type::Move: {
+    destination += "// Move\n";
+    const std::string c = popValue(destination);
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    destination += "if (" + c + " > 0) {\n"
+                   "std::memmove(reinterpret_cast<void *>(" + b +
+                   "), reinterpret_cast<const void *>(" + a +
+                   "), std::size_t(" + c + "));\n"
+                   "}\n";
+  } break;
+  case Expression::Type::Fill: {
+    destination += "// Fill\n";
+    const std::string c = popValue(destination);
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    destination += "if (" + b + " > 0) {\n"
+                   "std::memset(reinterpret_cast<void *>(" + a +
+                   "), int(std::uint8_t(" + c + ")), std::size_t(" + b +
+                   "));\n"
+                   "}\n";
+  } break;
+  case Expression::Type::Compare: {
+    destination += "// Compare\n";
+    const std::string d = popValue(destination);
+    const std::string c = popValue(destination);
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    pushValue(bindValue(
+        "compare(" + a + ", " + b + ", " + c + ", " + d + ")", destination));
+  } break;
+  case Expression::Type::Scan: {
+    destination += "// Scan\n";
+    const std::string c = popValue(destination);
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    const std::string rest =
+        bindValue("scan(" + a + ", " + b + ", " + c + ")", destination);
+    pushValue(bindValue("(" + a + ") + ((" + b + ") > 0 ? (" + b +
+                            ") : 0) - " + rest,
+                        destination));
+    pushValue(rest);
+  } break;
 
   case Expression::Type::DotS:
     break;
@@ -289,111 +560,519 @@ void Compiler::compileExpression(const Expression &expression,
                    "exit(EXIT_SUCCESS);\n";
     break;
 
-  case Expression::Type::WordDefinition: {
-    const Expression::WordDefinition &definition =
-        std::get<Expression::WordDefinition>(expression.data);
-    if (dictionary.contains(definition.word)) {
-      std::cerr << __FILE__ << ":" << __LINE__
-                << ": word already defined: " << definition.word << "\n";
-      exit(EXIT_FAILURE);
-    }
-
-    dictionary[definition.word] = {nextDictionaryName, definition};
-
-    declarationSection += "// Declare " + definition.word +
-                          "\n"
-                          "void word_" +
-                          std::to_string(nextDictionaryName) + "();\n";
-
-    ++nextDictionaryName;
+  case Expression::Type::AddLit: {
+    destination += "// AddLit\n";
+    const std::string a = popValue(destination);
+    pushValue(bindValue(
+        a + " + " + literal(std::get<std::int64_t>(expression.data)),
+        destination));
+  } break;
+  case Expression::Type::MoreLit:
+    pushValue(literal(std::get<std::int64_t>(expression.data)));
+    compileComparison("MoreLit", ">", destination);
+    break;
+  case Expression::Type::LessLit:
+    pushValue(literal(std::get<std::int64_t>(expression.data)));
+    compileComparison("LessLit", "<", destination);
+    break;
+  case Expression::Type::EqualLit:
+    pushValue(literal(std::get<std::int64_t>(expression.data)));
+    compileComparison("EqualLit", "==", destination);
+    break;
+  case Expression::Type::NotEqualLit:
+    pushValue(literal(std::get<std::int64_t>(expression.data)));
+    compileComparison("NotEqualLit", "!=", destination);
+    break;
+  case Expression::Type::TwoDup: {
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    pushValue(a);
+    pushValue(b);
+    pushValue(a);
+    pushValue(b);
+  } break;
+  case Expression::Type::TwoDrop:
+    dropValue(destination);
+    dropValue(destination);
+    break;
+  case Expression::Type::Nip: {
+    const std::string b = popValue(destination);
+    dropValue(destination);
+    pushValue(b);
+  } break;
+  case Expression::Type::MinusRot: {
+    const std::string c = popValue(destination);
+    const std::string b = popValue(destination);
+    const std::string a = popValue(destination);
+    pushValue(c);
+    pushValue(a);
+    pushValue(b);
   } break;
 
+  case Expression::Type::WordDefinition:
+    // Already in the dictionary; see defineNested.
+    break;
+
   case Expression::Type::IfThen: {
     const std::vector<Expression> &body =
         std::get<std::vector<Expression>>(expression.data);
-    destination += "// IfThen\n"
-                   "if (int64ToBool(parameterStack.pop())) {\n";
-    compileBody(body, destination);
+    destination += "// IfThen\n";
+    const std::string flag = popValue(destination);
+    flushValues(destination);
+    destination += "if (int64ToBool(" + flag + ")) {\n";
+    compileBody(body, destination, tail);
+    flushValues(destination);
     destination += "}\n";
   } break;
   case Expression::Type::IfElseThen: {
     const Expression::IfElse &ifElse =
         std::get<Expression::IfElse>(expression.data);
-    destination += "// IfElseThen\n"
-                   "if (int64ToBool(parameterStack.pop())) {\n";
-    compileBody(ifElse.ifBody, destination);
+    destination += "// IfElseThen\n";
+    const std::string flag = popValue(destination);
+    flushValues(destination);
+    destination += "if (int64ToBool(" + flag + ")) {\n";
+    compileBody(ifElse.ifBody, destination, tail);
+    flushValues(destination);
     destination += "} else {\n";
-    compileBody(ifElse.elseBody, destination);
+    compileBody(ifElse.elseBody, destination, tail);
+    flushValues(destination);
     destination += "}\n";
   } break;
 
   case Expression::Type::BeginUntil: {
     const std::vector<Expression> &body =
         std::get<std::vector<Expression>>(expression.data);
+    flushValues(destination);
     destination += "// BeginUntil\n"
-                   "do {\n";
+                   "while (true) {\n";
     compileBody(body, destination);
-    destination += "} while (!int64ToBool(parameterStack.pop()));\n";
+    const std::string flag = popValue(destination);
+    flushValues(destination);
+    destination += "if (int64ToBool(" + flag +
+                   ")) {\n"
+                   "break;\n"
+                   "}\n"
+                   "}\n";
   } break;
   case Expression::Type::BeginWhileRepeat: {
     const Expression::BeginWhile &beginWhile =
         std::get<Expression::BeginWhile>(expression.data);
-    destination += "// BeginWhileRepeat\n";
+    flushValues(destination);
+    destination += "// BeginWhileRepeat\n"
+                   "while (true) {\n";
     compileBody(beginWhile.condBody, destination);
-    destination += "while (int64ToBool(parameterStack.pop())) {\n";
+    const std::string flag = popValue(destination);
+    flushValues(destination);
+    destination += "if (!int64ToBool(" + flag +
+                   ")) {\n"
+                   "break;\n"
+                   "}\n";
     compileBody(beginWhile.whileBody, destination);
-    compileBody(beginWhile.condBody, destination);
+    flushValues(destination);
     destination += "}\n";
   } break;
   case Expression::Type::BeginAgain: {
     const std::vector<Expression> &body =
         std::get<std::vector<Expression>>(expression.data);
+    flushValues(destination);
     destination += "// BeginAgain\n"
                    "while (true) {\n";
     compileBody(body, destination);
+    flushValues(destination);
     destination += "}\n";
   } break;
+
+  // The index is only stepped after the stack model has been flushed, so
+  // values naming it never see it change.
+  case Expression::Type::DoLoop:
+  case Expression::Type::DoPlusLoop: {
+    const std::vector<Expression> &body =
+        std::get<std::vector<Expression>>(expression.data);
+    const bool plus = expression.type == Expression::Type::DoPlusLoop;
+    const std::string start = popValue(destination);
+    const std::string limit = popValue(destination);
+    flushValues(destination);
+    const std::string local = std::to_string(nextLocal++);
+    loops.push_back(Loop{"index" + local, "limit" + local, "leave" + local,
+                         false});
+    destination += std::string(plus ? "// DoPlusLoop\n" : "// DoLoop\n") +
+                   "{\n"
+                   "std::int64_t " + loops.back().index + " = " + start +
+                   ";\n"
+                   "const std::int64_t " + loops.back().limit + " = " + limit +
+                   ";\n"
+                   "while (true) {\n";
+    compileBody(body, destination);
+    if (plus) {
+      const std::string step = popValue(destination);
+      flushValues(destination);
+      destination += "if (!advanceLoop(" + loops.back().index + ", " +
+                     loops.back().limit + ", " + step + ")) {\n";
+    } else {
+      flushValues(destination);
+      destination += "if (++" + loops.back().index +
+                     " == " + loops.back().limit + ") {\n";
+    }
+    destination += "break;\n"
+                   "}\n"
+                   "}\n"
+                   "}\n";
+    if (loops.back().left) {
+      destination += loops.back().end + ":;\n";
+    }
+    loops.pop_back();
+  } break;
+  case Expression::Type::Leave:
+    flushValues(destination);
+    destination += "// Leave\n"
+                   "goto " + loops.back().end + ";\n";
+    loops.back().left = true;
+    break;
   }
 }
 
 void Compiler::write(std::ostream &destination) {
   destination << "// HEADER\n"
+                 "#include <csignal>\n"
                  "#include <cstring>\n"
+                 "#include <cstddef>\n"
                  "#include <cstdint>\n"
+                 "#include <cstdio>\n"
+                 "#include <cstdlib>\n"
                  "#include <iostream>\n"
+                 "#include <memory>\n"
+                 "#include <string>\n"
                  "#include <vector>\n"
+                 "#include <unistd.h>\n"
+                 "#ifndef STACK_SIZE\n"
+                 "#define STACK_SIZE "
+              << options.stackSize
+              << "\n"
+                 "#endif\n"
+                 "#ifndef OUTPUT_SIZE\n"
+                 "#define OUTPUT_SIZE "
+              << options.outputBuffer
+              << "\n"
+                 "#endif\n"
                  "class Stack {\n"
                  "private:\n"
-                 "std::vector<std::int64_t> data;\n"
+                 "std::int64_t data[STACK_SIZE];\n"
+                 "std::int64_t *top = data;\n"
                  "public:\n"
-                 "void push(std::int64_t number) { data.push_back(number); }\n"
+                 "void push(std::int64_t number) {\n"
+                 "#ifdef STACKER_DEBUG\n"
+                 "if (top == data + STACK_SIZE) {\n"
+                 "std::cerr << \"stack overflow\\n\";\n"
+                 "std::exit(EXIT_FAILURE);\n"
+                 "}\n"
+                 "#endif\n"
+                 "*top++ = number;\n"
+                 "}\n"
                  "std::int64_t pop() {\n"
-                 "const std::int64_t result = data.back();\n"
-                 "data.pop_back();\n"
-                 "return result;\n"
+                 "#ifdef STACKER_DEBUG\n"
+                 "if (top == data) {\n"
+                 "std::cerr << \"empty stack\\n\";\n"
+                 "std::exit(EXIT_FAILURE);\n"
                  "}\n"
+                 "#endif\n"
+                 "return *--top;\n"
+                 "}\n"
+                 "};\n"
+                 "static Stack parameterStack;\n"
+                 "static Stack returnStack;\n"
+                 "class Region {\n"
+                 "private:\n"
+                 "struct Chunk {\n"
+                 "std::unique_ptr<std::uint8_t[]> data;\n"
+                 "std::int64_t start;\n"
+                 "std::int64_t size;\n"
                  "};\n"
-                 "Stack parameterStack;\n"
-                 "Stack returnStack;\n"
+                 "std::vector<Chunk> chunks;\n"
+                 "std::size_t current = 0;\n"
+                 "std::int64_t used = 0;\n"
+                 "public:\n"
+                 "std::uint8_t *allocate(std::int64_t size) {\n"
+                 "if (size <= 0) {\n"
+                 "std::cerr << \"expected positive alloc\\n\";\n"
+                 "std::exit(EXIT_FAILURE);\n"
+                 "}\n"
+                 "size = (size + 15) / 16 * 16;\n"
+                 "while (current < chunks.size() &&\n"
+                 "chunks[current].size - used < size) {\n"
+                 "++current;\n"
+                 "used = 0;\n"
+                 "}\n"
+                 "if (current == chunks.size()) {\n"
+                 "const std::int64_t start =\n"
+                 "chunks.empty() ? 0\n"
+                 ": chunks.back().start + chunks.back().size;\n"
+                 "const std::int64_t chunkSize = size > 65536 ? size : 65536;\n"
+                 "chunks.push_back(\n"
+                 "{std::make_unique_for_overwrite<std::uint8_t[]>(chunkSize),\n"
+                 "start, chunkSize});\n"
+                 "}\n"
+                 "std::uint8_t *const addr =\n"
+                 "chunks[current].data.get() + used;\n"
+                 "used += size;\n"
+                 "return addr;\n"
+                 "}\n"
+                 "std::int64_t mark() const {\n"
+                 "return current < chunks.size()\n"
+                 "? chunks[current].start + used : 0;\n"
+                 "}\n"
+                 "void release(std::int64_t mark) {\n"
+                 "if (mark < 0 || mark > this->mark()) {\n"
+                 "std::cerr << \"improper region release\\n\";\n"
+                 "std::exit(EXIT_FAILURE);\n"
+                 "}\n"
+                 "while (current > 0 && chunks[current].start > mark) {\n"
+                 "--current;\n"
+                 "}\n"
+                 "used = mark - (chunks.empty() ? 0 : chunks[current].start);\n"
+                 "}\n"
+                 "};\n"
+                 "static Region region;\n"
                  "std::int64_t boolToInt64(bool b) { return b ? ~0 : 0; }\n"
                  "bool int64ToBool(std::int64_t i) { return i != 0; }\n"
-              << declarationSection;
+                 "bool advanceLoop(std::int64_t &index, std::int64_t limit,\n"
+                 "std::int64_t step) {\n"
+                 "const std::uint64_t before =\n"
+                 "std::uint64_t(index) - std::uint64_t(limit);\n"
+                 "const std::uint64_t after = before + std::uint64_t(step);\n"
+                 "index = std::int64_t(\n"
+                 "std::uint64_t(index) + std::uint64_t(step));\n"
+                 "return std::int64_t(before ^ after) >= 0;\n"
+                 "}\n"
+                 "std::int64_t acceptLine(std::int64_t addr,\n"
+                 "std::int64_t max) {\n"
+                 "std::fflush(stdout);\n"
+                 "char *const data = reinterpret_cast<char *>(addr);\n"
+                 "std::int64_t length = 0;\n"
+                 "while (length < max) {\n"
+                 "const int ch = std::getc(stdin);\n"
+                 "if (ch == EOF || ch == '\\n') {\n"
+                 "break;\n"
+                 "}\n"
+                 "data[length++] = char(ch);\n"
+                 "}\n"
+                 "return length;\n"
+                 "}\n"
+                 "void pushCopy(const std::string &contents) {\n"
+                 "std::uint8_t *const addr =\n"
+                 "new std::uint8_t[contents.size() + 1];\n"
+                 "std::memcpy(addr, contents.data(), contents.size());\n"
+                 "parameterStack.push(reinterpret_cast<std::int64_t>(addr));\n"
+                 "parameterStack.push(contents.size());\n"
+                 "}\n"
+                 "void readLine() {\n"
+                 "std::fflush(stdout);\n"
+                 "std::string line;\n"
+                 "int ch;\n"
+                 "while ((ch = std::getc(stdin)) != EOF && ch != '\\n') {\n"
+                 "line.push_back(char(ch));\n"
+                 "}\n"
+                 "if (ch == EOF && line.empty()) {\n"
+                 "parameterStack.push(0);\n"
+                 "parameterStack.push(-1);\n"
+                 "} else {\n"
+                 "pushCopy(line);\n"
+                 "}\n"
+                 "}\n"
+                 "std::int64_t compare(std::int64_t a, std::int64_t aLength,\n"
+                 "std::int64_t b, std::int64_t bLength) {\n"
+                 "aLength = aLength > 0 ? aLength : 0;\n"
+                 "bLength = bLength > 0 ? bLength : 0;\n"
+                 "const int order =\n"
+                 "std::memcmp(reinterpret_cast<const void *>(a),\n"
+                 "reinterpret_cast<const void *>(b),\n"
+                 "std::size_t(aLength < bLength ? aLength : bLength));\n"
+                 "if (order != 0) {\n"
+                 "return order < 0 ? -1 : 1;\n"
+                 "}\n"
+                 "return aLength < bLength ? -1 : aLength > bLength ? 1 : 0;\n"
+                 "}\n"
+                 "// Length of the rest of addr from the first byte equal to\n"
+                 "// byte on, or 0.\n"
+                 "std::int64_t scan(std::int64_t addr, std::int64_t length,\n"
+                 "std::int64_t byte) {\n"
+                 "if (length <= 0) {\n"
+                 "return 0;\n"
+                 "}\n"
+                 "const void *const found =\n"
+                 "std::memchr(reinterpret_cast<const void *>(addr),\n"
+                 "int(std::uint8_t(byte)), std::size_t(length));\n"
+                 "return found\n"
+                 "? addr + length - reinterpret_cast<std::int64_t>(found)\n"
+                 ": 0;\n"
+                 "}\n"
+                 "void slurp(std::int64_t addr, std::int64_t length) {\n"
+                 "const std::string path(\n"
+                 "reinterpret_cast<const char *>(addr),\n"
+                 "length > 0 ? length : 0);\n"
+                 "std::FILE *file = stdin;\n"
+                 "if (path.empty()) {\n"
+                 "std::fflush(stdout);\n"
+                 "} else if (!(file = std::fopen(path.c_str(), \"rb\"))) {\n"
+                 "parameterStack.push(0);\n"
+                 "parameterStack.push(-1);\n"
+                 "return;\n"
+                 "}\n"
+                 "std::string contents;\n"
+                 "char buffer[1 << 16];\n"
+                 "std::size_t count;\n"
+                 "while ((count =\n"
+                 "std::fread(buffer, 1, sizeof(buffer), file)) > 0) {\n"
+                 "contents.append(buffer, count);\n"
+                 "}\n"
+                 "const bool ok = !std::ferror(file);\n"
+                 "if (file != stdin) {\n"
+                 "std::fclose(file);\n"
+                 "}\n"
+                 "if (ok) {\n"
+                 "pushCopy(contents);\n"
+                 "} else {\n"
+                 "parameterStack.push(0);\n"
+                 "parameterStack.push(-1);\n"
+                 "}\n"
+                 "}\n"
+                 "struct Next {\n"
+                 "Next (*word)();\n"
+                 "};\n"
+                 "void call(Next next) {\n"
+                 "while (next.word) {\n"
+                 "next = next.word();\n"
+                 "}\n"
+                 "}\n"
+;
+
+  // Words the program never reaches are not written out, but what they call
+  // must still be defined.
+  for (const auto &[word, namedDefinition] : dictionary) {
+    std::map<std::string, int> bodyCalls;
+    countCalls(namedDefinition.definition.body, bodyCalls);
+    for (const auto &[callee, count] : bodyCalls) {
+      if (!dictionary.contains(callee)) {
+        std::cerr << __FILE__ << ":" << __LINE__
+                  << ": unknown word: " << callee << "\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  // Only words reachable from the top level are written out. Of those, the
+  // ones called once and not recursively are spliced into their caller.
+  std::map<std::string, int> calls;
+  countCalls(mainBody, calls);
+  std::set<std::string> reachable;
+  std::vector<std::string> pending;
+  for (const auto &[word, count] : calls) {
+    pending.push_back(word);
+  }
+  while (!pending.empty()) {
+    const std::string word = pending.back();
+    pending.pop_back();
+    const auto &find = dictionary.find(word);
+    if (find == dictionary.end() || !reachable.insert(word).second) {
+      continue;
+    }
+    std::map<std::string, int> bodyCalls;
+    countCalls(find->second.definition.body, bodyCalls);
+    for (const auto &[callee, count] : bodyCalls) {
+      calls[callee] += count;
+      pending.push_back(callee);
+    }
+  }
+  splicedWords.clear();
+  for (const std::string &word : reachable) {
+    if (calls[word] == 1 && !reaches(word, word)) {
+      splicedWords.insert(word);
+    }
+  }
+
+  for (const std::string &word : reachable) {
+    if (!splicedWords.contains(word)) {
+      destination << "// Declare " << word << "\n"
+                  << "Next word_" << dictionary[word].name << "();\n";
+    }
+  }
+
+  // Definitions are held back until the literals they use are known.
+  std::string definitions;
+  for (const std::string &word : reachable) {
+    if (splicedWords.contains(word)) {
+      continue;
+    }
+    const NamedDefinition &namedDefinition = dictionary[word];
+    currentWord = namedDefinition.name;
+    tailRecursive = false;
+    std::string bodyStr;
+    compileBody(namedDefinition.definition.body, bodyStr, true);
+    flushValues(bodyStr);
 
-  for (const auto &pair : dictionary) {
-    const NamedDefinition namedDefinition = pair.second;
     std::string definitionStr = "// Define " + namedDefinition.definition.word +
                                 "\n"
-                                "void word_" +
+                                "Next word_" +
                                 std::to_string(namedDefinition.name) + "() {\n";
-    compileBody(namedDefinition.definition.body, definitionStr);
-    definitionStr += "}\n";
-    destination << definitionStr;
+    if (tailRecursive) {
+      definitionStr += "start:\n";
+    }
+    definitionStr += bodyStr + "return {};\n}\n";
+    definitions += definitionStr;
   }
 
+  currentWord = -1;
+  std::string mainSection;
+  compileBody(mainBody, mainSection);
+  flushValues(mainSection);
+
+  for (const auto &[str, name] : literals) {
+    destination << "static const char " << name << "[] = " << cppLiteral(str)
+                << ";\n";
+  }
+  // Literals live in read-only memory, so a store into one faults, and is
+  // reported the way the interpreter reports it.
+  std::string installHandler;
+  if (!literals.empty()) {
+    destination << "struct LiteralRange {\n"
+                   "const char *data;\n"
+                   "std::size_t size;\n"
+                   "};\n"
+                   "static const LiteralRange literalRanges[] = {\n";
+    for (const auto &[str, name] : literals) {
+      destination << "{" << name << ", sizeof(" << name << ")},\n";
+    }
+    destination
+        << "};\n"
+           "void reportLiteralStore(int, siginfo_t *info, void *) {\n"
+           "const auto addr = reinterpret_cast<std::uintptr_t>("
+           "info->si_addr);\n"
+           "for (const LiteralRange &range : literalRanges) {\n"
+           "const auto data = reinterpret_cast<std::uintptr_t>(range.data);\n"
+           "if (addr >= data && addr < data + range.size) {\n"
+           "static const char message[] = "
+           "\"store into a string literal\\n\";\n"
+           "write(STDERR_FILENO, message, sizeof(message) - 1);\n"
+           "_exit(EXIT_FAILURE);\n"
+           "}\n"
+           "}\n"
+           "}\n";
+    installHandler = "struct sigaction action = {};\n"
+                     "action.sa_sigaction = reportLiteralStore;\n"
+                     "action.sa_flags = SA_SIGINFO | SA_RESETHAND;\n"
+                     "sigaction(SIGSEGV, &action, nullptr);\n";
+  }
   destination
+      << definitions
       << "// BODY\n"
          "int main(int argc, char** argv) {\n"
-         "for (int i = argc - 1; i >= 0; --i) {\n"
+         "#if OUTPUT_SIZE > 0\n"
+         "static char outputBuffer[OUTPUT_SIZE];\n"
+         "std::setvbuf(stdout, outputBuffer, _IOFBF, OUTPUT_SIZE);\n"
+         "#else\n"
+         "std::setvbuf(stdout, nullptr, _IONBF, 0);\n"
+         "#endif\n"
+      << installHandler
+      << "for (int i = argc - 1; i >= 0; --i) {\n"
          "parameterStack.push(reinterpret_cast<std::int64_t>(argv[i]));\n"
          "parameterStack.push(std::strlen(argv[i]));\n"
          "}\n"
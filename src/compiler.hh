@@ -1,33 +1,92 @@
 #ifndef COMPILER_HH
 #define COMPILER_HH
 
+#include <cstddef>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "parser.hh"
 
 class Compiler {
+public:
+  struct Options {
+    bool inlining = true;
+    std::size_t stackSize = std::size_t(1) << 20;
+    std::size_t outputBuffer = std::size_t(1) << 16;
+  };
+
 private:
   struct NamedDefinition {
     int name;
     Expression::WordDefinition definition;
   };
   std::map<std::string, NamedDefinition> dictionary;
-  int nextDictionaryName;
+  int nextDictionaryName = 0;
+  Options options;
+
+  // Top-level code, compiled by write once it is known which words survive.
+  std::vector<Expression> mainBody;
+  // Words called from exactly one place, compiled into that place instead of
+  // into a function of their own.
+  std::set<std::string> splicedWords;
+  // String literals, written once each as static data, and their names.
+  std::map<std::string, std::string> literals;
+
+  // Compile-time model of the top of the parameter stack: C++ expressions,
+  // bottom first, whose values have not been pushed at runtime yet.
+  std::vector<std::string> values;
+  int nextLocal = 0;
+
+  // Native locals holding the index and limit of each do loop being
+  // compiled, innermost last, and the label its leaves jump to if it has any.
+  struct Loop {
+    std::string index;
+    std::string limit;
+    std::string end;
+    bool left;
+  };
+  std::vector<Loop> loops;
+
+  static std::string literal(std::int64_t number);
+  std::string bindValue(const std::string &value, std::string &destination);
+  void pushValue(const std::string &value);
+  std::string popValue(std::string &destination);
+  void dropValue(std::string &destination);
+  void flushValues(std::string &destination);
+  void compileBinary(const std::string &name, const std::string &op,
+                     std::string &destination);
+  void compileComparison(const std::string &name, const std::string &op,
+                         std::string &destination);
 
-  std::string declarationSection;
-  std::string mainSection;
+  // Name of the word being written, and whether it jumps back to its start
+  // from a self-recursive tail call. Other tail calls return the callee to
+  // the caller's call loop, so that no tail call grows the native stack.
+  int currentWord = -1;
+  bool tailRecursive = false;
+
+  // tail is set when nothing in the word follows the code being compiled.
+  void define(Expression::WordDefinition definition);
+  void defineNested(const Expression &expression);
+  void defineNestedBody(const std::vector<Expression> &body);
+  void countCalls(const std::vector<Expression> &body,
+                  std::map<std::string, int> &calls);
+  bool reaches(const std::string &from, const std::string &to);
 
   void compileBody(const std::vector<Expression> &body,
-                   std::string &destination);
+                   std::string &destination, bool tail = false);
   void compileExpression(const Expression &expression,
-                         std::string &destination);
+                         std::string &destination, bool tail = false);
 
 public:
-  void compile(std::istream &source);
+  Compiler();
+  explicit Compiler(const Options &options);
+
+  void compile(Lexer &source);
   void write(std::ostream &destination);
 };
 
@@ -2,19 +2,94 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <optional>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "bulk.hh"
+#include "optimizer.hh"
 #include "parser.hh"
 
 std::int64_t boolToInt64(bool b);
 bool int64ToBool(std::int64_t i);
+std::size_t toLength(std::int64_t n);
+bool advanceLoop(std::int64_t &index, std::int64_t limit, std::int64_t step);
+std::int64_t acceptLine(char *addr, std::int64_t max);
+bool readLine(std::string &line);
+bool readFile(const std::string &path, std::string &contents);
 
 std::int64_t boolToInt64(bool b) { return b ? ~0 : 0; }
 bool int64ToBool(std::int64_t i) { return i != 0; }
+std::size_t toLength(std::int64_t n) {
+  return std::size_t(std::max(n, std::int64_t(0)));
+}
+
+// Steps the index of a +loop and tells whether the loop goes on, that is
+// whether the index did not cross from limit - 1 to limit either way.
+bool advanceLoop(std::int64_t &index, std::int64_t limit, std::int64_t step) {
+  const std::uint64_t before = std::uint64_t(index) - std::uint64_t(limit);
+  const std::uint64_t after = before + std::uint64_t(step);
+  index = std::int64_t(std::uint64_t(index) + std::uint64_t(step));
+  return std::int64_t(before ^ after) >= 0;
+}
+
+// Input goes through stdio rather than std::cin, which is synced with it,
+// so that key, the lexer and these can share stdin.
+std::int64_t acceptLine(char *addr, std::int64_t max) {
+  std::fflush(stdout);
+  std::int64_t length = 0;
+  while (length < max) {
+    const int ch = std::getc(stdin);
+    if (ch == EOF || ch == '\n') {
+      break;
+    }
+    addr[length++] = char(ch);
+  }
+  return length;
+}
+
+bool readLine(std::string &line) {
+  std::fflush(stdout);
+  line.clear();
+  int ch;
+  while ((ch = std::getc(stdin)) != EOF && ch != '\n') {
+    line.push_back(char(ch));
+  }
+  return ch != EOF || !line.empty();
+}
+
+// An empty path reads the rest of stdin.
+bool readFile(const std::string &path, std::string &contents) {
+  std::FILE *file = stdin;
+  if (path.empty()) {
+    std::fflush(stdout);
+  } else if (!(file = std::fopen(path.c_str(), "rb"))) {
+    return false;
+  }
+  contents.clear();
+  char buffer[1 << 16];
+  std::size_t count;
+  while ((count = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    contents.append(buffer, count);
+  }
+  const bool ok = !std::ferror(file);
+  if (file != stdin) {
+    std::fclose(file);
+  }
+  return ok;
+}
+
+Engine::Engine() : Engine(Options()) {}
+
+Engine::Engine(const Options &options)
+    : options(options), parameterStack(options.stackSize),
+      returnStack(options.stackSize) {}
 
 void Engine::pushArgs(const std::vector<const char *> &args) {
   for (auto it = args.rbegin(); it != args.rend(); ++it) {
@@ -24,85 +99,1261 @@ void Engine::pushArgs(const std::vector<const char *> &args) {
   parameterStack.push(std::int64_t(args.size()));
 }
 
-void Engine::Stack::push(std::int64_t number) { data.push_back(number); }
+Engine::Stack::Stack(std::size_t capacity)
+    : data(std::make_unique_for_overwrite<std::int64_t[]>(capacity + 1)),
+      bottom(data.get() + 1), top(bottom), limit(bottom + capacity) {}
+
+void Engine::Stack::push(std::int64_t number) {
+  if (top == limit) {
+    std::cerr << __FILE__ << ":" << __LINE__ << ": stack overflow\n";
+    exit(EXIT_FAILURE);
+  }
+  *top++ = number;
+}
 
 std::int64_t Engine::Stack::pop() {
-  if (data.empty()) {
+  if (top == bottom) {
     std::cerr << __FILE__ << ":" << __LINE__ << ": empty stack\n";
     exit(EXIT_FAILURE);
   }
-  const std::int64_t result = data.back();
-  data.pop_back();
-  return result;
+  return *--top;
 }
 
-bool Engine::Stack::empty() { return data.empty(); }
+bool Engine::Stack::empty() { return top == bottom; }
+
+std::size_t Engine::Stack::size() { return top - bottom; }
 
 void Engine::Stack::debug() {
-  std::cout << "<" << data.size() << "> ";
-  for (const std::int64_t number : data) {
-    std::cout << number << " ";
+  std::cout << "<" << size() << "> ";
+  for (const std::int64_t *it = bottom; it != top; ++it) {
+    std::cout << *it << " ";
   }
 }
 
-bool Engine::evalBody(const std::vector<Expression> &body) {
+bool Engine::evalBody(const std::vector<Expression> &body, bool tail) {
   for (const Expression &expr : body) {
-    if (!evalExpression(expr)) {
+    if (leaving) {
+      return true;
+    }
+    if (!evalExpression(expr, tail && &expr == &body.back())) {
       return false;
     }
   }
   return true;
 }
 
-void Engine::define(const std::string &word,
-                    const std::vector<Expression> &body) {
+void Engine::define(const std::string &word, std::vector<Expression> body) {
   if (dictionary.contains(word)) {
     std::cerr << __FILE__ << ":" << __LINE__
               << ": word already defined: " << word << "\n";
     exit(EXIT_FAILURE);
   }
-  dictionary[word] = body;
+  const std::vector<Expression> &stored = dictionary[word] = std::move(body);
+
+  if (!options.treeWalker) {
+    Word &slot = words[resolve(word)];
+    slot.entry = code.size();
+    slot.defined = true;
+    startBlock();
+    lowerBody(stored);
+    emit(Instruction::Op::Return);
+    eliminateTailCalls(slot.entry);
+  }
+}
+
+std::int64_t Engine::allocate(std::int64_t size) {
+  if (size <= 0) {
+    std::cerr << "expected positive alloc\n";
+    exit(EXIT_FAILURE);
+  }
+  return reinterpret_cast<std::int64_t>(heap.allocate(std::size_t(size)));
+}
+
+void Engine::release(std::int64_t addr) {
+  if (!heap.release(reinterpret_cast<std::uint8_t *>(addr))) {
+    std::cerr << __FILE__ << ":" << __LINE__ << "improper free\n";
+    exit(EXIT_FAILURE);
+  }
+}
+
+std::int64_t Engine::allocateInRegion(std::int64_t size) {
+  if (size <= 0) {
+    std::cerr << "expected positive alloc\n";
+    exit(EXIT_FAILURE);
+  }
+  return reinterpret_cast<std::int64_t>(region.allocate(std::size_t(size)));
 }
 
-bool Engine::eval(std::istream &source) {
+void Engine::releaseRegion(std::int64_t mark) {
+  if (mark < 0 || !region.release(std::size_t(mark))) {
+    std::cerr << __FILE__ << ":" << __LINE__ << ": improper region release\n";
+    exit(EXIT_FAILURE);
+  }
+}
+
+// The copy is freed with free like any allocation, so even empty contents
+// get a byte.
+std::int64_t Engine::allocateCopy(std::string_view contents) {
+  const std::int64_t addr =
+      allocate(std::max(std::int64_t(contents.size()), std::int64_t(1)));
+  std::memcpy(reinterpret_cast<void *>(addr), contents.data(),
+              contents.size());
+  return addr;
+}
+
+std::size_t Engine::intern(const std::string &str) {
+  const auto &find = stringIndices.find(str);
+  if (find != stringIndices.end()) {
+    return find->second;
+  }
+  const std::size_t index = strings.size();
+  strings.push_back(literals.add(str));
+  stringIndices.emplace(strings.back(), index);
+  return index;
+}
+
+std::size_t Engine::resolve(const std::string &word) {
+  const auto &find = wordIndices.find(word);
+  if (find != wordIndices.end()) {
+    return find->second;
+  }
+  const std::size_t index = words.size();
+  words.push_back(Word{word, 0, false});
+  wordIndices[word] = index;
+  return index;
+}
+
+bool Engine::eval(Lexer &source) {
   std::optional<Expression> expression;
   while ((expression = parse(source))) {
-    if (!evalExpression(*expression)) {
+    if (options.inlining) {
+      inlineCalls(*expression,
+                  [this](const std::string &word)
+                      -> const std::vector<Expression> * {
+                    const auto &find = dictionary.find(word);
+                    if (find == dictionary.end()) {
+                      return nullptr;
+                    }
+                    return &find->second;
+                  });
+    }
+    fuse(*expression);
+    if (expression->type == Expression::Type::WordDefinition) {
+      Expression::WordDefinition &definition =
+          std::get<Expression::WordDefinition>(expression->data);
+      define(definition.word, std::move(definition.body));
+      continue;
+    }
+    if (options.treeWalker) {
+      if (!evalExpression(*expression)) {
+        return false;
+      }
+      continue;
+    }
+
+    const std::size_t entry = code.size();
+    startBlock();
+    lowerExpression(*expression);
+    emit(Instruction::Op::Return);
+    if (!execute(entry)) {
       return false;
     }
   }
   return true;
 }
 
-bool Engine::evalExpression(const Expression &expression) {
+void Engine::emit(Instruction::Op op, std::int64_t operand) {
+  code.push_back(Instruction{op, operand});
+
+  const StackEffect effect = stackEffect(op);
+  blockNeed = std::max(blockNeed, effect.in - blockDepth);
+  blockDepth += effect.out - effect.in;
+  blockGrow = std::max(blockGrow, blockDepth);
+  code[blockCheck].operand = blockNeed | blockGrow << 32;
+
+  // The depth after a call is unknown, and the fall-through of a branch must
+  // not be charged for instructions the branch may skip.
+  switch (op) {
+  case Instruction::Op::Call:
+  case Instruction::Op::TailCall:
+  case Instruction::Op::JumpIfZero:
+  case Instruction::Op::JumpUnlessMoreLit:
+  case Instruction::Op::JumpUnlessLessLit:
+  case Instruction::Op::JumpUnlessEqualLit:
+  case Instruction::Op::JumpUnlessNotEqualLit:
+  case Instruction::Op::Loop:
+  case Instruction::Op::PlusLoop:
+    startBlock();
+    break;
+  default:
+    break;
+  }
+}
+
+// A JumpIfZero that directly follows a comparison against a literal in the
+// same block is folded into it, keeping the literal in the high half of the
+// operand.
+std::size_t Engine::emitJump(Instruction::Op op) {
+  if (op == Instruction::Op::JumpIfZero && code.size() - 1 > blockCheck) {
+    Instruction &last = code.back();
+    const std::int64_t literal = last.operand;
+    if (literal == std::int32_t(literal)) {
+      Instruction::Op fused = op;
+      switch (last.op) {
+      case Instruction::Op::MoreLit:
+        fused = Instruction::Op::JumpUnlessMoreLit;
+        break;
+      case Instruction::Op::LessLit:
+        fused = Instruction::Op::JumpUnlessLessLit;
+        break;
+      case Instruction::Op::EqualLit:
+        fused = Instruction::Op::JumpUnlessEqualLit;
+        break;
+      case Instruction::Op::NotEqualLit:
+        fused = Instruction::Op::JumpUnlessNotEqualLit;
+        break;
+      default:
+        break;
+      }
+      if (fused != op) {
+        code.pop_back();
+        const std::size_t jump = code.size();
+        emit(fused, literal * (std::int64_t(1) << 32));
+        return jump;
+      }
+    }
+  }
+  const std::size_t jump = code.size();
+  emit(op);
+  return jump;
+}
+
+void Engine::patchJump(std::size_t jump, std::size_t target) {
+  const std::int64_t offset = std::int64_t(target) - std::int64_t(jump);
+  std::int64_t &operand = code[jump].operand;
+  operand = (operand & ~std::int64_t(0xffffffff)) | std::uint32_t(offset);
+}
+
+void Engine::startBlock() {
+  blockCheck = code.size();
+  blockDepth = 0;
+  blockNeed = 0;
+  blockGrow = 0;
+  code.push_back(Instruction{Instruction::Op::Check, 0});
+}
+
+// Whether control reaching target goes straight to a Return, passing only
+// through jumps and checks that check nothing.
+bool Engine::returnsAt(std::size_t target) {
+  for (std::size_t steps = 0; steps < code.size(); ++steps) {
+    const Instruction &instruction = code[target];
+    switch (instruction.op) {
+    case Instruction::Op::Check:
+      if (instruction.operand != 0) {
+        return false;
+      }
+      ++target;
+      break;
+    case Instruction::Op::Jump:
+      target += std::int32_t(instruction.operand);
+      break;
+    case Instruction::Op::Return:
+      return true;
+    default:
+      return false;
+    }
+  }
+  return false;
+}
+
+// Rewrites the calls in the word starting at entry that are followed only by
+// its return, so that they reuse the caller's frame.
+void Engine::eliminateTailCalls(std::size_t entry) {
+  for (std::size_t i = entry; i < code.size(); ++i) {
+    if (code[i].op == Instruction::Op::Call && returnsAt(i + 1)) {
+      code[i].op = Instruction::Op::TailCall;
+    }
+  }
+}
+
+void Engine::lowerBody(const std::vector<Expression> &body) {
+  for (const Expression &expr : body) {
+    lowerExpression(expr);
+  }
+}
+
+void Engine::lowerExpression(const Expression &expression) {
+  switch (expression.type) {
+
+  case Expression::Type::Number:
+    emit(Instruction::Op::Number, std::get<std::int64_t>(expression.data));
+    break;
+  case Expression::Type::String:
+    emit(Instruction::Op::String,
+         std::int64_t(intern(std::get<std::string>(expression.data))));
+    break;
+  case Expression::Type::Word:
+    emit(Instruction::Op::Call,
+         std::int64_t(resolve(std::get<std::string>(expression.data))));
+    break;
+
+  case Expression::Type::Add:
+    emit(Instruction::Op::Add);
+    break;
+  case Expression::Type::Sub:
+    emit(Instruction::Op::Sub);
+    break;
+  case Expression::Type::Mul:
+    emit(Instruction::Op::Mul);
+    break;
+  case Expression::Type::Div:
+    emit(Instruction::Op::Div);
+    break;
+  case Expression::Type::Rem:
+    emit(Instruction::Op::Rem);
+    break;
+  case Expression::Type::Mod:
+    emit(Instruction::Op::Mod);
+    break;
+
+  case Expression::Type::More:
+    emit(Instruction::Op::More);
+    break;
+  case Expression::Type::Less:
+    emit(Instruction::Op::Less);
+    break;
+  case Expression::Type::Equal:
+    emit(Instruction::Op::Equal);
+    break;
+  case Expression::Type::NotEqual:
+    emit(Instruction::Op::NotEqual);
+    break;
+
+  case Expression::Type::And:
+    emit(Instruction::Op::And);
+    break;
+  case Expression::Type::Or:
+    emit(Instruction::Op::Or);
+    break;
+  case Expression::Type::Inv:
+    emit(Instruction::Op::Inv);
+    break;
+
+  case Expression::Type::Emit:
+    emit(Instruction::Op::Emit);
+    break;
+  case Expression::Type::Key:
+    emit(Instruction::Op::Key);
+    break;
+  case Expression::Type::Type:
+    emit(Instruction::Op::Type);
+    break;
+  case Expression::Type::Flush:
+    emit(Instruction::Op::Flush);
+    break;
+  case Expression::Type::Accept:
+    emit(Instruction::Op::Accept);
+    break;
+  case Expression::Type::ReadLine:
+    emit(Instruction::Op::ReadLine);
+    break;
+  case Expression::Type::Slurp:
+    emit(Instruction::Op::Slurp);
+    break;
+
+  case Expression::Type::Dup:
+    emit(Instruction::Op::Dup);
+    break;
+  case Expression::Type::Drop:
+    emit(Instruction::Op::Drop);
+    break;
+  case Expression::Type::Swap:
+    emit(Instruction::Op::Swap);
+    break;
+  case Expression::Type::Over:
+    emit(Instruction::Op::Over);
+    break;
+  case Expression::Type::Rot:
+    emit(Instruction::Op::Rot);
+    break;
+
+  case Expression::Type::ToR:
+    emit(Instruction::Op::ToR);
+    break;
+  case Expression::Type::RFrom:
+    emit(Instruction::Op::RFrom);
+    break;
+  case Expression::Type::RFetch:
+    emit(Instruction::Op::RFetch);
+    break;
+  case Expression::Type::I:
+    emit(Instruction::Op::I);
+    break;
+  case Expression::Type::J:
+    emit(Instruction::Op::J);
+    break;
+
+  case Expression::Type::Store:
+    emit(Instruction::Op::Store);
+    break;
+  case Expression::Type::Fetch:
+    emit(Instruction::Op::Fetch);
+    break;
+  case Expression::Type::CStore:
+    emit(Instruction::Op::CStore);
+    break;
+  case Expression::Type::CFetch:
+    emit(Instruction::Op::CFetch);
+    break;
+  case Expression::Type::Alloc:
+    emit(Instruction::Op::Alloc);
+    break;
+  case Expression::Type::Free:
+    emit(Instruction::Op::Free);
+    break;
+  case Expression::Type::RegionAlloc:
+    emit(Instruction::Op::RegionAlloc);
+    break;
+  case Expression::Type::RegionMark:
+    emit(Instruction::Op::RegionMark);
+    break;
+  case Expression::Type::RegionRelease:
+    emit(Instruction::Op::RegionRelease);
+    break;
+  case Expression::Type::Strdup:
+    emit(Instruction::Op::Strdup);
+    break;
+  case Expression::Type::Move:
+    emit(Instruction::Op::Move);
+    break;
+  case Expression::Type::Fill:
+    emit(Instruction::Op::Fill);
+    break;
+  case Expression::Type::Compare:
+    emit(Instruction::Op::Compare);
+    break;
+  case Expression::Type::Scan:
+    emit(Instruction::Op::Scan);
+    break;
+
+  case Expression::Type::DotS:
+    emit(Instruction::Op::DotS);
+    break;
+  case Expression::Type::Bye:
+    emit(Instruction::Op::Bye);
+    break;
+
+  case Expression::Type::AddLit:
+    emit(Instruction::Op::AddLit, std::get<std::int64_t>(expression.data));
+    break;
+  case Expression::Type::MoreLit:
+    emit(Instruction::Op::MoreLit, std::get<std::int64_t>(expression.data));
+    break;
+  case Expression::Type::LessLit:
+    emit(Instruction::Op::LessLit, std::get<std::int64_t>(expression.data));
+    break;
+  case Expression::Type::EqualLit:
+    emit(Instruction::Op::EqualLit, std::get<std::int64_t>(expression.data));
+    break;
+  case Expression::Type::NotEqualLit:
+    emit(Instruction::Op::NotEqualLit,
+         std::get<std::int64_t>(expression.data));
+    break;
+  case Expression::Type::TwoDup:
+    emit(Instruction::Op::TwoDup);
+    break;
+  case Expression::Type::TwoDrop:
+    emit(Instruction::Op::TwoDrop);
+    break;
+  case Expression::Type::Nip:
+    emit(Instruction::Op::Nip);
+    break;
+  case Expression::Type::MinusRot:
+    emit(Instruction::Op::MinusRot);
+    break;
+
+  case Expression::Type::WordDefinition:
+    emit(Instruction::Op::Define, std::int64_t(nestedDefinitions.size()));
+    nestedDefinitions.push_back(
+        std::get<Expression::WordDefinition>(expression.data));
+    break;
+
+  case Expression::Type::IfThen: {
+    const std::vector<Expression> &body =
+        std::get<std::vector<Expression>>(expression.data);
+    const std::size_t jumpEnd = emitJump(Instruction::Op::JumpIfZero);
+    lowerBody(body);
+    patchJump(jumpEnd, code.size());
+    startBlock();
+  } break;
+  case Expression::Type::IfElseThen: {
+    const Expression::IfElse &ifElse =
+        std::get<Expression::IfElse>(expression.data);
+    const std::size_t jumpElse = emitJump(Instruction::Op::JumpIfZero);
+    lowerBody(ifElse.ifBody);
+    const std::size_t jumpEnd = emitJump(Instruction::Op::Jump);
+    patchJump(jumpElse, code.size());
+    startBlock();
+    lowerBody(ifElse.elseBody);
+    patchJump(jumpEnd, code.size());
+    startBlock();
+  } break;
+
+  case Expression::Type::BeginUntil: {
+    const std::vector<Expression> &body =
+        std::get<std::vector<Expression>>(expression.data);
+    const std::size_t begin = code.size();
+    startBlock();
+    lowerBody(body);
+    patchJump(emitJump(Instruction::Op::JumpIfZero), begin);
+    startBlock();
+  } break;
+  case Expression::Type::BeginWhileRepeat: {
+    const Expression::BeginWhile &beginWhile =
+        std::get<Expression::BeginWhile>(expression.data);
+    const std::size_t begin = code.size();
+    startBlock();
+    lowerBody(beginWhile.condBody);
+    const std::size_t jumpEnd = emitJump(Instruction::Op::JumpIfZero);
+    lowerBody(beginWhile.whileBody);
+    patchJump(emitJump(Instruction::Op::Jump), begin);
+    patchJump(jumpEnd, code.size());
+    startBlock();
+  } break;
+  case Expression::Type::BeginAgain: {
+    const std::vector<Expression> &body =
+        std::get<std::vector<Expression>>(expression.data);
+    const std::size_t begin = code.size();
+    startBlock();
+    lowerBody(body);
+    patchJump(emitJump(Instruction::Op::Jump), begin);
+    startBlock();
+  } break;
+
+  case Expression::Type::DoLoop:
+  case Expression::Type::DoPlusLoop: {
+    const std::vector<Expression> &body =
+        std::get<std::vector<Expression>>(expression.data);
+    emit(Instruction::Op::Do);
+    const std::size_t begin = code.size();
+    startBlock();
+    leaveJumps.emplace_back();
+    lowerBody(body);
+    patchJump(emitJump(expression.type == Expression::Type::DoLoop
+                           ? Instruction::Op::Loop
+                           : Instruction::Op::PlusLoop),
+              begin);
+    for (const std::size_t jump : leaveJumps.back()) {
+      patchJump(jump, code.size());
+    }
+    leaveJumps.pop_back();
+    startBlock();
+  } break;
+  case Expression::Type::Leave:
+    if (leaveJumps.empty()) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ": leave outside a loop\n";
+      exit(EXIT_FAILURE);
+    }
+    leaveJumps.back().push_back(emitJump(Instruction::Op::Leave));
+    break;
+  }
+}
+
+constexpr Engine::StackEffect Engine::stackEffect(Instruction::Op op) {
+  switch (op) {
+  case Instruction::Op::Number:
+    return {0, 1};
+  case Instruction::Op::String:
+    return {0, 2};
+  case Instruction::Op::Call:
+  case Instruction::Op::TailCall:
+  case Instruction::Op::Define:
+    return {0, 0};
+
+  case Instruction::Op::Add:
+  case Instruction::Op::Sub:
+  case Instruction::Op::Mul:
+  case Instruction::Op::Div:
+  case Instruction::Op::Rem:
+  case Instruction::Op::Mod:
+  case Instruction::Op::More:
+  case Instruction::Op::Less:
+  case Instruction::Op::Equal:
+  case Instruction::Op::NotEqual:
+  case Instruction::Op::And:
+  case Instruction::Op::Or:
+    return {2, 1};
+  case Instruction::Op::Inv:
+    return {1, 1};
+
+  case Instruction::Op::Emit:
+    return {1, 0};
+  case Instruction::Op::Key:
+    return {0, 1};
+  case Instruction::Op::Type:
+    return {2, 0};
+  case Instruction::Op::Flush:
+    return {0, 0};
+  case Instruction::Op::Accept:
+    return {2, 1};
+  case Instruction::Op::ReadLine:
+    return {0, 2};
+  case Instruction::Op::Slurp:
+    return {2, 2};
+
+  case Instruction::Op::Dup:
+    return {1, 2};
+  case Instruction::Op::Drop:
+    return {1, 0};
+  case Instruction::Op::Swap:
+    return {2, 2};
+  case Instruction::Op::Over:
+    return {2, 3};
+  case Instruction::Op::Rot:
+    return {3, 3};
+
+  case Instruction::Op::ToR:
+    return {1, 0};
+  case Instruction::Op::RFrom:
+  case Instruction::Op::RFetch:
+  case Instruction::Op::I:
+  case Instruction::Op::J:
+    return {0, 1};
+
+  case Instruction::Op::Store:
+  case Instruction::Op::CStore:
+    return {2, 0};
+  case Instruction::Op::Fetch:
+  case Instruction::Op::CFetch:
+  case Instruction::Op::Alloc:
+  case Instruction::Op::RegionAlloc:
+    return {1, 1};
+  case Instruction::Op::Free:
+  case Instruction::Op::RegionRelease:
+    return {1, 0};
+  case Instruction::Op::RegionMark:
+    return {0, 1};
+  case Instruction::Op::Strdup:
+    return {2, 2};
+  case Instruction::Op::Move:
+  case Instruction::Op::Fill:
+    return {3, 0};
+  case Instruction::Op::Compare:
+    return {4, 1};
+  case Instruction::Op::Scan:
+    return {3, 2};
+
+  case Instruction::Op::DotS:
+  case Instruction::Op::Bye:
+    return {0, 0};
+
+  case Instruction::Op::AddLit:
+  case Instruction::Op::MoreLit:
+  case Instruction::Op::LessLit:
+  case Instruction::Op::EqualLit:
+  case Instruction::Op::NotEqualLit:
+    return {1, 1};
+  case Instruction::Op::TwoDup:
+    return {2, 4};
+  case Instruction::Op::TwoDrop:
+    return {2, 0};
+  case Instruction::Op::Nip:
+    return {2, 1};
+  case Instruction::Op::MinusRot:
+    return {3, 3};
+
+  case Instruction::Op::Check:
+  case Instruction::Op::Jump:
+    return {0, 0};
+  case Instruction::Op::JumpIfZero:
+  case Instruction::Op::JumpUnlessMoreLit:
+  case Instruction::Op::JumpUnlessLessLit:
+  case Instruction::Op::JumpUnlessEqualLit:
+  case Instruction::Op::JumpUnlessNotEqualLit:
+    return {1, 0};
+  case Instruction::Op::Do:
+    return {2, 0};
+  case Instruction::Op::Loop:
+  case Instruction::Op::Leave:
+    return {0, 0};
+  case Instruction::Op::PlusLoop:
+    return {1, 0};
+  case Instruction::Op::Return:
+    return {0, 0};
+  }
+
+  std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected\n";
+  exit(EXIT_FAILURE);
+}
+
+#ifdef STACKER_THREADED
+// Direct threading: every instruction carries the address of its handler and
+// each handler ends in its own indirect jump to the next one.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define CASE(op) op:
+#define NEXT                                                                   \
+  do {                                                                         \
+    instruction = ip++;                                                        \
+    goto *instruction->handler;                                                \
+  } while (false)
+#else
+#define CASE(op) case Instruction::Op::op:
+#define NEXT break
+#endif
+
+// The dispatch loop keeps the parameter stack in two locals: tos holds the
+// top element and sp points at the slot tos would be spilled to, so the
+// depth is sp - floor. Stack bounds are only tested by the Check that opens
+// each straight-line block; every other instruction trusts it. The index
+// and limit of the innermost do loop are kept in locals as well.
+bool Engine::execute(std::size_t entry) {
+  std::vector<Frame> frames;
+  const Instruction *ip = code.data() + entry;
+
+  std::int64_t *const floor = parameterStack.bottom - 1;
+  const std::ptrdiff_t capacity = parameterStack.limit - parameterStack.bottom;
+  std::int64_t *sp = parameterStack.top - 1;
+  std::int64_t tos = *sp;
+  std::int64_t index = 0;
+  std::int64_t limit = 0;
+
+  const Instruction *instruction;
+
+#ifdef STACKER_THREADED
+  static const void *const HANDLERS[] = {
+      &&Number, &&String, &&Call, &&TailCall, &&Define,
+
+      &&Add, &&Sub, &&Mul, &&Div, &&Rem, &&Mod,
+
+      &&More, &&Less, &&Equal, &&NotEqual,
+
+      &&And, &&Or, &&Inv,
+
+      &&Emit, &&Key, &&Type, &&Flush, &&Accept, &&ReadLine, &&Slurp,
+
+      &&Dup, &&Drop, &&Swap, &&Over, &&Rot,
+
+      &&ToR, &&RFrom, &&RFetch, &&I, &&J,
+
+      &&Store, &&Fetch, &&CStore, &&CFetch, &&Alloc, &&Free,
+      &&RegionAlloc, &&RegionMark, &&RegionRelease, &&Strdup,
+      &&Move, &&Fill, &&Compare, &&Scan,
+
+      &&DotS, &&Bye,
+
+      &&AddLit, &&MoreLit, &&LessLit, &&EqualLit, &&NotEqualLit,
+      &&TwoDup, &&TwoDrop, &&Nip, &&MinusRot,
+
+      &&Check, &&Jump, &&JumpIfZero,
+      &&JumpUnlessMoreLit, &&JumpUnlessLessLit,
+      &&JumpUnlessEqualLit, &&JumpUnlessNotEqualLit,
+      &&Do, &&Loop, &&PlusLoop, &&Leave,
+      &&Return,
+  };
+  static_assert(std::size(HANDLERS) ==
+                std::size_t(Instruction::Op::Return) + 1);
+
+  for (; threaded < code.size(); ++threaded) {
+    code[threaded].handler = HANDLERS[std::size_t(code[threaded].op)];
+  }
+
+  NEXT;
+  {
+#else
+  while (true) {
+    instruction = ip++;
+
+    switch (instruction->op) {
+#endif
+
+    CASE(Number)
+      *sp++ = tos;
+      tos = instruction->operand;
+      NEXT;
+    CASE(String) {
+      const std::string_view str = strings[instruction->operand];
+      *sp++ = tos;
+      *sp++ = reinterpret_cast<std::int64_t>(str.data());
+      tos = std::int64_t(str.size());
+    } NEXT;
+    CASE(Call) {
+      Word &word = words[instruction->operand];
+      if (!word.defined) {
+        std::cerr << __FILE__ << ":" << __LINE__
+                  << ": unknown word: " << word.name << "\n";
+        exit(EXIT_FAILURE);
+      }
+      if (word.calls < options.jitThreshold &&
+          ++word.calls == options.jitThreshold) {
+        word.native = jit.compile(*this, instruction->operand);
+      }
+      if (word.native) {
+        *sp = tos;
+        Jit::State state{sp,
+                         floor,
+                         floor + capacity,
+                         returnStack.top,
+                         returnStack.top,
+                         returnStack.limit};
+        switch (word.native(&state)) {
+        case Jit::Status::Ok:
+          break;
+        case Jit::Status::EmptyStack:
+          std::cerr << __FILE__ << ":" << __LINE__ << ": empty stack\n";
+          exit(EXIT_FAILURE);
+        case Jit::Status::StackOverflow:
+          std::cerr << __FILE__ << ":" << __LINE__ << ": stack overflow\n";
+          exit(EXIT_FAILURE);
+        case Jit::Status::EmptyReturnStack:
+          std::cerr << __FILE__ << ":" << __LINE__ << ": empty return stack\n";
+          exit(EXIT_FAILURE);
+        case Jit::Status::UnbalancedReturnStack:
+          std::cerr << __FILE__ << ":" << __LINE__
+                    << ": expected empty return stack\n";
+          exit(EXIT_FAILURE);
+        }
+        sp = state.sp;
+        tos = *sp;
+        returnStack.top = state.returnTop;
+        NEXT;
+      }
+      frames.push_back(Frame{std::size_t(ip - code.data()), returnBase});
+      returnBase = returnStack.size();
+      ip = code.data() + word.entry;
+    } NEXT;
+    CASE(TailCall) {
+      const Word &word = words[instruction->operand];
+      if (!word.defined) {
+        std::cerr << __FILE__ << ":" << __LINE__
+                  << ": unknown word: " << word.name << "\n";
+        exit(EXIT_FAILURE);
+      }
+      if (returnStack.size() != returnBase) {
+        std::cerr << __FILE__ << ":" << __LINE__
+                  << ": expected empty return stack\n";
+        exit(EXIT_FAILURE);
+      }
+      ip = code.data() + word.entry;
+    } NEXT;
+    CASE(Define) {
+      // Lowering the new word appends to code, which may move it.
+      const std::size_t returnAddress = std::size_t(ip - code.data());
+      const Expression::WordDefinition &definition =
+          nestedDefinitions[std::size_t(instruction->operand)];
+      define(definition.word, definition.body);
+      ip = code.data() + returnAddress;
+#ifdef STACKER_THREADED
+      for (; threaded < code.size(); ++threaded) {
+        code[threaded].handler = HANDLERS[std::size_t(code[threaded].op)];
+      }
+#endif
+    } NEXT;
+
+    CASE(Add)
+      tos = *--sp + tos;
+      NEXT;
+    CASE(Sub)
+      tos = *--sp - tos;
+      NEXT;
+    CASE(Mul)
+      tos = *--sp * tos;
+      NEXT;
+    CASE(Div)
+      tos = *--sp / tos;
+      NEXT;
+    CASE(Rem)
+      tos = *--sp % tos;
+      NEXT;
+    CASE(Mod)
+      tos = (*--sp % tos + tos) % tos;
+      NEXT;
+
+    CASE(More)
+      tos = boolToInt64(*--sp > tos);
+      NEXT;
+    CASE(Less)
+      tos = boolToInt64(*--sp < tos);
+      NEXT;
+    CASE(Equal)
+      tos = boolToInt64(*--sp == tos);
+      NEXT;
+    CASE(NotEqual)
+      tos = boolToInt64(*--sp != tos);
+      NEXT;
+
+    CASE(And)
+      tos = *--sp & tos;
+      NEXT;
+    CASE(Or)
+      tos = *--sp | tos;
+      NEXT;
+    CASE(Inv)
+      tos = ~tos;
+      NEXT;
+
+    CASE(Emit)
+      std::putc(int(tos), stdout);
+      tos = *--sp;
+      NEXT;
+    CASE(Key)
+      std::fflush(stdout);
+      *sp++ = tos;
+      tos = std::cin.get();
+      NEXT;
+    CASE(Type)
+      if (tos > 0) {
+        std::fwrite(reinterpret_cast<const char *>(sp[-1]), 1,
+                    std::size_t(tos), stdout);
+      }
+      sp -= 2;
+      tos = *sp;
+      NEXT;
+    CASE(Flush)
+      std::fflush(stdout);
+      NEXT;
+    CASE(Accept)
+      tos = acceptLine(reinterpret_cast<char *>(sp[-1]), tos);
+      --sp;
+      NEXT;
+    CASE(ReadLine) {
+      *sp++ = tos;
+      std::string line;
+      if (readLine(line)) {
+        *sp++ = allocateCopy(line);
+        tos = std::int64_t(line.size());
+      } else {
+        *sp++ = 0;
+        tos = -1;
+      }
+    } NEXT;
+    CASE(Slurp) {
+      const std::string path(reinterpret_cast<const char *>(sp[-1]),
+                             std::size_t(std::max(tos, std::int64_t(0))));
+      std::string contents;
+      if (readFile(path, contents)) {
+        sp[-1] = allocateCopy(contents);
+        tos = std::int64_t(contents.size());
+      } else {
+        sp[-1] = 0;
+        tos = -1;
+      }
+    } NEXT;
+
+    CASE(Dup)
+      *sp++ = tos;
+      NEXT;
+    CASE(Drop)
+      tos = *--sp;
+      NEXT;
+    CASE(Swap) {
+      const std::int64_t a = sp[-1];
+      sp[-1] = tos;
+      tos = a;
+    } NEXT;
+    CASE(Over) {
+      const std::int64_t a = sp[-1];
+      *sp++ = tos;
+      tos = a;
+    } NEXT;
+    CASE(Rot) {
+      const std::int64_t a = sp[-2];
+      sp[-2] = sp[-1];
+      sp[-1] = tos;
+      tos = a;
+    } NEXT;
+
+    CASE(ToR)
+      returnStack.push(tos);
+      tos = *--sp;
+      NEXT;
+    CASE(RFrom)
+      if (returnStack.size() == returnBase) {
+        std::cerr << __FILE__ << ":" << __LINE__ << ": empty return stack\n";
+        exit(EXIT_FAILURE);
+      }
+      *sp++ = tos;
+      tos = returnStack.pop();
+      NEXT;
+    CASE(RFetch) {
+      if (returnStack.size() == returnBase) {
+        std::cerr << __FILE__ << ":" << __LINE__ << ": empty return stack\n";
+        exit(EXIT_FAILURE);
+      }
+      const std::int64_t a = returnStack.pop();
+      returnStack.push(a);
+      *sp++ = tos;
+      tos = a;
+    } NEXT;
+    CASE(I)
+      *sp++ = tos;
+      tos = index;
+      NEXT;
+    CASE(J)
+      *sp++ = tos;
+      tos = loops.back().index;
+      NEXT;
+
+    CASE(Store)
+      *reinterpret_cast<std::int64_t *>(tos) = sp[-1];
+      sp -= 2;
+      tos = *sp;
+      NEXT;
+    CASE(Fetch)
+      tos = *reinterpret_cast<std::int64_t *>(tos);
+      NEXT;
+    CASE(CStore)
+      *reinterpret_cast<char *>(tos) = char(sp[-1]);
+      sp -= 2;
+      tos = *sp;
+      NEXT;
+    CASE(CFetch)
+      tos = *reinterpret_cast<char *>(tos);
+      NEXT;
+    CASE(Alloc)
+      tos = allocate(tos);
+      NEXT;
+    CASE(Free)
+      release(tos);
+      tos = *--sp;
+      NEXT;
+    CASE(RegionAlloc)
+      tos = allocateInRegion(tos);
+      NEXT;
+    CASE(RegionMark)
+      *sp++ = tos;
+      tos = std::int64_t(region.mark());
+      NEXT;
+    CASE(RegionRelease)
+      releaseRegion(tos);
+      tos = *--sp;
+      NEXT;
+    CASE(Strdup)
+      sp[-1] = allocateCopy(
+          std::string_view(reinterpret_cast<const char *>(sp[-1]),
+                           toLength(tos)));
+      NEXT;
+    CASE(Move)
+      bulkMove(reinterpret_cast<std::uint8_t *>(sp[-1]),
+               reinterpret_cast<const std::uint8_t *>(sp[-2]), toLength(tos));
+      sp -= 3;
+      tos = *sp;
+      NEXT;
+    CASE(Fill)
+      bulkFill(reinterpret_cast<std::uint8_t *>(sp[-2]), toLength(sp[-1]),
+               std::uint8_t(tos));
+      sp -= 3;
+      tos = *sp;
+      NEXT;
+    CASE(Compare)
+      tos = bulkCompare(reinterpret_cast<const std::uint8_t *>(sp[-3]),
+                        toLength(sp[-2]),
+                        reinterpret_cast<const std::uint8_t *>(sp[-1]),
+                        toLength(tos));
+      sp -= 3;
+      NEXT;
+    CASE(Scan) {
+      const std::size_t length = toLength(sp[-1]);
+      const std::size_t offset = bulkScan(
+          reinterpret_cast<const std::uint8_t *>(sp[-2]), length,
+          std::uint8_t(tos));
+      sp[-2] += std::int64_t(offset);
+      tos = std::int64_t(length - offset);
+      --sp;
+    } NEXT;
+
+    CASE(DotS)
+      *sp = tos;
+      parameterStack.top = sp + 1;
+      parameterStack.debug();
+      NEXT;
+    CASE(Bye)
+      *sp = tos;
+      parameterStack.top = sp + 1;
+      return false;
+
+    CASE(AddLit)
+      tos += instruction->operand;
+      NEXT;
+    CASE(MoreLit)
+      tos = boolToInt64(tos > instruction->operand);
+      NEXT;
+    CASE(LessLit)
+      tos = boolToInt64(tos < instruction->operand);
+      NEXT;
+    CASE(EqualLit)
+      tos = boolToInt64(tos == instruction->operand);
+      NEXT;
+    CASE(NotEqualLit)
+      tos = boolToInt64(tos != instruction->operand);
+      NEXT;
+    CASE(TwoDup) {
+      const std::int64_t a = sp[-1];
+      sp[0] = tos;
+      sp[1] = a;
+      sp += 2;
+    } NEXT;
+    CASE(TwoDrop)
+      sp -= 2;
+      tos = *sp;
+      NEXT;
+    CASE(Nip)
+      --sp;
+      NEXT;
+    CASE(MinusRot) {
+      const std::int64_t c = tos;
+      tos = sp[-1];
+      sp[-1] = sp[-2];
+      sp[-2] = c;
+    } NEXT;
+
+    CASE(Check) {
+      const std::ptrdiff_t depth = sp - floor;
+      if (depth < (instruction->operand & 0xffffffff)) {
+        std::cerr << __FILE__ << ":" << __LINE__ << ": empty stack\n";
+        exit(EXIT_FAILURE);
+      }
+      if (depth + (instruction->operand >> 32) > capacity) {
+        std::cerr << __FILE__ << ":" << __LINE__ << ": stack overflow\n";
+        exit(EXIT_FAILURE);
+      }
+    } NEXT;
+    CASE(Jump)
+      ip += std::int32_t(instruction->operand) - 1;
+      NEXT;
+    CASE(JumpIfZero) {
+      const std::int64_t flag = tos;
+      tos = *--sp;
+      if (!int64ToBool(flag)) {
+        ip += std::int32_t(instruction->operand) - 1;
+      }
+    } NEXT;
+    CASE(JumpUnlessMoreLit) {
+      const std::int64_t a = tos;
+      tos = *--sp;
+      if (!(a > instruction->operand >> 32)) {
+        ip += std::int32_t(instruction->operand) - 1;
+      }
+    } NEXT;
+    CASE(JumpUnlessLessLit) {
+      const std::int64_t a = tos;
+      tos = *--sp;
+      if (!(a < instruction->operand >> 32)) {
+        ip += std::int32_t(instruction->operand) - 1;
+      }
+    } NEXT;
+    CASE(JumpUnlessEqualLit) {
+      const std::int64_t a = tos;
+      tos = *--sp;
+      if (a != instruction->operand >> 32) {
+        ip += std::int32_t(instruction->operand) - 1;
+      }
+    } NEXT;
+    CASE(JumpUnlessNotEqualLit) {
+      const std::int64_t a = tos;
+      tos = *--sp;
+      if (a == instruction->operand >> 32) {
+        ip += std::int32_t(instruction->operand) - 1;
+      }
+    } NEXT;
+    CASE(Do)
+      loops.push_back(LoopFrame{index, limit});
+      index = tos;
+      limit = sp[-1];
+      sp -= 2;
+      tos = *sp;
+      NEXT;
+    CASE(Loop)
+      if (++index != limit) {
+        ip += std::int32_t(instruction->operand) - 1;
+      } else {
+        index = loops.back().index;
+        limit = loops.back().limit;
+        loops.pop_back();
+      }
+      NEXT;
+    CASE(PlusLoop) {
+      const std::int64_t step = tos;
+      tos = *--sp;
+      if (advanceLoop(index, limit, step)) {
+        ip += std::int32_t(instruction->operand) - 1;
+      } else {
+        index = loops.back().index;
+        limit = loops.back().limit;
+        loops.pop_back();
+      }
+    } NEXT;
+    CASE(Leave)
+      index = loops.back().index;
+      limit = loops.back().limit;
+      loops.pop_back();
+      ip += std::int32_t(instruction->operand) - 1;
+      NEXT;
+    CASE(Return) {
+      if (frames.empty()) {
+        *sp = tos;
+        parameterStack.top = sp + 1;
+        return true;
+      }
+      if (returnStack.size() != returnBase) {
+        std::cerr << __FILE__ << ":" << __LINE__
+                  << ": expected empty return stack\n";
+        exit(EXIT_FAILURE);
+      }
+      const Frame &frame = frames.back();
+      returnBase = frame.returnBase;
+      ip = code.data() + frame.returnAddress;
+      frames.pop_back();
+    } NEXT;
+#ifndef STACKER_THREADED
+    }
+#endif
+  }
+}
+
+#undef CASE
+#undef NEXT
+#ifdef STACKER_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+bool Engine::evalExpression(const Expression &expression, bool tail) {
   switch (expression.type) {
 
   case Expression::Type::Number:
     parameterStack.push(std::get<std::int64_t>(expression.data));
     return true;
   case Expression::Type::String: {
-    const std::string &str = std::get<std::string>(expression.data);
-    std::uint8_t *const addr = new std::uint8_t[str.size()];
-    allocs.insert(addr);
-    std::memcpy(addr, str.data(), str.size());
-    parameterStack.push(reinterpret_cast<std::int64_t>(addr));
+    const std::string_view str =
+        strings[intern(std::get<std::string>(expression.data))];
+    parameterStack.push(reinterpret_cast<std::int64_t>(str.data()));
     parameterStack.push(std::int64_t(str.size()));
     return true;
   }
   case Expression::Type::Word: {
     const std::string &word = std::get<std::string>(expression.data);
     const auto &find = dictionary.find(word);
-    if (find != dictionary.end()) {
-      Stack returnStackMove = std::move(returnStack);
-      returnStack = Stack();
-      const std::vector<Expression> &body = find->second;
-      evalBody(body);
-      if (!returnStack.empty()) {
+    if (find != dictionary.end() && tail) {
+      if (returnStack.size() != returnBase) {
+        std::cerr << __FILE__ << ":" << __LINE__
+                  << ": expected empty return stack\n";
+        exit(EXIT_FAILURE);
+      }
+      tailCall = &find->second;
+    } else if (find != dictionary.end()) {
+      const std::size_t callerReturnBase = returnBase;
+      returnBase = returnStack.size();
+      for (const std::vector<Expression> *body = &find->second; body;
+           body = tailCall) {
+        tailCall = nullptr;
+        evalBody(*body, true);
+      }
+      if (returnStack.size() != returnBase) {
         std::cerr << __FILE__ << ":" << __LINE__
                   << ": expected empty return stack\n";
         exit(EXIT_FAILURE);
       }
-      returnStack = std::move(returnStackMove);
+      returnBase = callerReturnBase;
     } else {
       std::cerr << __FILE__ << ":" << __LINE__ << ": unknown word: " << word
                 << "\n";
@@ -190,11 +1441,56 @@ bool Engine::evalExpression(const Expression &expression) {
     return true;
 
   case Expression::Type::Emit:
-    std::cout.put(char(parameterStack.pop()));
+    std::putc(int(parameterStack.pop()), stdout);
     return true;
   case Expression::Type::Key:
+    std::fflush(stdout);
     parameterStack.push(std::cin.get());
     return true;
+  case Expression::Type::Type: {
+    const std::int64_t b = parameterStack.pop();
+    const std::int64_t a = parameterStack.pop();
+    if (b > 0) {
+      std::fwrite(reinterpret_cast<const char *>(a), 1, std::size_t(b),
+                  stdout);
+    }
+    return true;
+  }
+  case Expression::Type::Flush:
+    std::fflush(stdout);
+    return true;
+  case Expression::Type::Accept: {
+    const std::int64_t b = parameterStack.pop();
+    const std::int64_t a = parameterStack.pop();
+    parameterStack.push(acceptLine(reinterpret_cast<char *>(a), b));
+    return true;
+  }
+  case Expression::Type::ReadLine: {
+    std::string line;
+    if (readLine(line)) {
+      parameterStack.push(allocateCopy(line));
+      parameterStack.push(std::int64_t(line.size()));
+    } else {
+      parameterStack.push(0);
+      parameterStack.push(-1);
+    }
+    return true;
+  }
+  case Expression::Type::Slurp: {
+    const std::int64_t b = parameterStack.pop();
+    const std::int64_t a = parameterStack.pop();
+    std::string contents;
+    if (readFile(std::string(reinterpret_cast<const char *>(a),
+                             std::size_t(std::max(b, std::int64_t(0)))),
+                 contents)) {
+      parameterStack.push(allocateCopy(contents));
+      parameterStack.push(std::int64_t(contents.size()));
+    } else {
+      parameterStack.push(0);
+      parameterStack.push(-1);
+    }
+    return true;
+  }
 
   case Expression::Type::Dup: {
     const std::int64_t a = parameterStack.pop();
@@ -234,14 +1530,36 @@ bool Engine::evalExpression(const Expression &expression) {
     returnStack.push(parameterStack.pop());
     return true;
   case Expression::Type::RFrom:
+    if (returnStack.size() == returnBase) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ": empty return stack\n";
+      exit(EXIT_FAILURE);
+    }
     parameterStack.push(returnStack.pop());
     return true;
   case Expression::Type::RFetch: {
+    if (returnStack.size() == returnBase) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ": empty return stack\n";
+      exit(EXIT_FAILURE);
+    }
     const std::int64_t a = returnStack.pop();
     returnStack.push(a);
     parameterStack.push(a);
     return true;
   }
+  case Expression::Type::I:
+    if (loops.empty()) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ": i outside a loop\n";
+      exit(EXIT_FAILURE);
+    }
+    parameterStack.push(loops.back().index);
+    return true;
+  case Expression::Type::J:
+    if (loops.size() < 2) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ": j outside a loop\n";
+      exit(EXIT_FAILURE);
+    }
+    parameterStack.push(loops[loops.size() - 2].index);
+    return true;
 
   case Expression::Type::Store: {
     const std::int64_t b = parameterStack.pop();
@@ -265,27 +1583,63 @@ bool Engine::evalExpression(const Expression &expression) {
     parameterStack.push(*reinterpret_cast<char *>(a));
     return true;
   }
-  case Expression::Type::Alloc: {
-    const std::int64_t size = parameterStack.pop();
-    if (size <= 0) {
-      std::cerr << "expected positive alloc\n";
-      exit(EXIT_FAILURE);
-    }
-    std::uint8_t *const addr = new std::uint8_t[size];
-    allocs.insert(addr);
-    parameterStack.push(reinterpret_cast<std::int64_t>(addr));
+  case Expression::Type::Alloc:
+    parameterStack.push(allocate(parameterStack.pop()));
+    return true;
+  case Expression::Type::Free:
+    release(parameterStack.pop());
+    return true;
+  case Expression::Type::RegionAlloc:
+    parameterStack.push(allocateInRegion(parameterStack.pop()));
+    return true;
+  case Expression::Type::RegionMark:
+    parameterStack.push(std::int64_t(region.mark()));
+    return true;
+  case Expression::Type::RegionRelease:
+    releaseRegion(parameterStack.pop());
+    return true;
+  case Expression::Type::Strdup: {
+    const std::int64_t b = parameterStack.pop();
+    const std::int64_t a = parameterStack.pop();
+    parameterStack.push(allocateCopy(
+        std::string_view(reinterpret_cast<const char *>(a), toLength(b))));
+    parameterStack.push(b);
     return true;
   }
-  case Expression::Type::Free: {
-    std::uint8_t *const addr =
-        reinterpret_cast<std::uint8_t *>(parameterStack.pop());
-    if (allocs.contains(addr)) {
-      allocs.erase(addr);
-      delete[] addr;
-    } else {
-      std::cerr << __FILE__ << ":" << __LINE__ << "improper free\n";
-      exit(EXIT_FAILURE);
-    }
+  case Expression::Type::Move: {
+    const std::int64_t c = parameterStack.pop();
+    const std::int64_t b = parameterStack.pop();
+    const std::int64_t a = parameterStack.pop();
+    bulkMove(reinterpret_cast<std::uint8_t *>(b),
+             reinterpret_cast<const std::uint8_t *>(a), toLength(c));
+    return true;
+  }
+  case Expression::Type::Fill: {
+    const std::int64_t c = parameterStack.pop();
+    const std::int64_t b = parameterStack.pop();
+    const std::int64_t a = parameterStack.pop();
+    bulkFill(reinterpret_cast<std::uint8_t *>(a), toLength(b),
+             std::uint8_t(c));
+    return true;
+  }
+  case Expression::Type::Compare: {
+    const std::int64_t d = parameterStack.pop();
+    const std::int64_t c = parameterStack.pop();
+    const std::int64_t b = parameterStack.pop();
+    const std::int64_t a = parameterStack.pop();
+    parameterStack.push(
+        bulkCompare(reinterpret_cast<const std::uint8_t *>(a), toLength(b),
+                    reinterpret_cast<const std::uint8_t *>(c), toLength(d)));
+    return true;
+  }
+  case Expression::Type::Scan: {
+    const std::int64_t c = parameterStack.pop();
+    const std::size_t b = toLength(parameterStack.pop());
+    const std::int64_t a = parameterStack.pop();
+    const std::size_t offset =
+        bulkScan(reinterpret_cast<const std::uint8_t *>(a), b, std::uint8_t(c));
+    parameterStack.push(a + std::int64_t(offset));
+    parameterStack.push(std::int64_t(b - offset));
     return true;
   }
 
@@ -295,6 +1649,55 @@ bool Engine::evalExpression(const Expression &expression) {
   case Expression::Type::Bye:
     return false;
 
+  case Expression::Type::AddLit:
+    parameterStack.push(parameterStack.pop() +
+                        std::get<std::int64_t>(expression.data));
+    return true;
+  case Expression::Type::MoreLit:
+    parameterStack.push(boolToInt64(parameterStack.pop() >
+                                    std::get<std::int64_t>(expression.data)));
+    return true;
+  case Expression::Type::LessLit:
+    parameterStack.push(boolToInt64(parameterStack.pop() <
+                                    std::get<std::int64_t>(expression.data)));
+    return true;
+  case Expression::Type::EqualLit:
+    parameterStack.push(boolToInt64(parameterStack.pop() ==
+                                    std::get<std::int64_t>(expression.data)));
+    return true;
+  case Expression::Type::NotEqualLit:
+    parameterStack.push(boolToInt64(parameterStack.pop() !=
+                                    std::get<std::int64_t>(expression.data)));
+    return true;
+  case Expression::Type::TwoDup: {
+    const std::int64_t b = parameterStack.pop();
+    const std::int64_t a = parameterStack.pop();
+    parameterStack.push(a);
+    parameterStack.push(b);
+    parameterStack.push(a);
+    parameterStack.push(b);
+    return true;
+  }
+  case Expression::Type::TwoDrop:
+    parameterStack.pop();
+    parameterStack.pop();
+    return true;
+  case Expression::Type::Nip: {
+    const std::int64_t b = parameterStack.pop();
+    parameterStack.pop();
+    parameterStack.push(b);
+    return true;
+  }
+  case Expression::Type::MinusRot: {
+    const std::int64_t c = parameterStack.pop();
+    const std::int64_t b = parameterStack.pop();
+    const std::int64_t a = parameterStack.pop();
+    parameterStack.push(c);
+    parameterStack.push(a);
+    parameterStack.push(b);
+    return true;
+  }
+
   case Expression::Type::WordDefinition: {
     const Expression::WordDefinition &definition =
         std::get<Expression::WordDefinition>(expression.data);
@@ -306,7 +1709,7 @@ bool Engine::evalExpression(const Expression &expression) {
     const std::vector<Expression> &body =
         std::get<std::vector<Expression>>(expression.data);
     if (int64ToBool(parameterStack.pop())) {
-      evalBody(body);
+      evalBody(body, tail);
     }
     return true;
   }
@@ -314,9 +1717,9 @@ bool Engine::evalExpression(const Expression &expression) {
     const Expression::IfElse &ifElse =
         std::get<Expression::IfElse>(expression.data);
     if (int64ToBool(parameterStack.pop())) {
-      evalBody(ifElse.ifBody);
+      evalBody(ifElse.ifBody, tail);
     } else {
-      evalBody(ifElse.elseBody);
+      evalBody(ifElse.elseBody, tail);
     }
     return true;
   }
@@ -326,14 +1729,14 @@ bool Engine::evalExpression(const Expression &expression) {
         std::get<std::vector<Expression>>(expression.data);
     do {
       evalBody(body);
-    } while (!int64ToBool(parameterStack.pop()));
+    } while (!leaving && !int64ToBool(parameterStack.pop()));
     return true;
   }
   case Expression::Type::BeginWhileRepeat: {
     const Expression::BeginWhile &beginWhile =
         std::get<Expression::BeginWhile>(expression.data);
     evalBody(beginWhile.condBody);
-    while (int64ToBool(parameterStack.pop())) {
+    while (!leaving && int64ToBool(parameterStack.pop())) {
       evalBody(beginWhile.whileBody);
       evalBody(beginWhile.condBody);
     }
@@ -342,12 +1745,39 @@ bool Engine::evalExpression(const Expression &expression) {
   case Expression::Type::BeginAgain: {
     const std::vector<Expression> &body =
         std::get<std::vector<Expression>>(expression.data);
-    while (true) {
+    while (!leaving) {
       evalBody(body);
     }
-    std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected\n";
-    exit(EXIT_FAILURE);
+    return true;
+  }
+
+  case Expression::Type::DoLoop:
+  case Expression::Type::DoPlusLoop: {
+    const std::vector<Expression> &body =
+        std::get<std::vector<Expression>>(expression.data);
+    const std::int64_t start = parameterStack.pop();
+    const std::int64_t limit = parameterStack.pop();
+    loops.push_back(LoopFrame{start, limit});
+    bool more = true;
+    while (more) {
+      if (!evalBody(body)) {
+        return false;
+      }
+      if (leaving) {
+        leaving = false;
+        break;
+      }
+      LoopFrame &loop = loops.back();
+      more = expression.type == Expression::Type::DoLoop
+                 ? ++loop.index != loop.limit
+                 : advanceLoop(loop.index, loop.limit, parameterStack.pop());
+    }
+    loops.pop_back();
+    return true;
   }
+  case Expression::Type::Leave:
+    leaving = true;
+    return true;
   }
 
   std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected\n";
@@ -355,7 +1785,7 @@ bool Engine::evalExpression(const Expression &expression) {
 }
 
 Engine::~Engine() {
-  if (!allocs.empty()) {
+  if (heap.live() != 0) {
     std::cerr << __FILE__ << ":" << __LINE__ << ": found memory leak\n";
     exit(EXIT_FAILURE);
   }
@@ -1,41 +1,250 @@
 #ifndef ENGINE_HH
 #define ENGINE_HH
 
+#include <cstddef>
 #include <cstdint>
 #include <map>
-#include <set>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "heap.hh"
+#include "jit.hh"
 #include "parser.hh"
 
 class Engine {
+public:
+  struct Options {
+    bool treeWalker = false;
+    bool inlining = true;
+    std::size_t stackSize = std::size_t(1) << 20;
+    // Calls after which a word is compiled to machine code; 0 never does.
+    std::uint32_t jitThreshold = 100;
+  };
+
 private:
+  // Fixed-capacity stack of cells. One cell below bottom is reserved so
+  // that Engine::execute can spill its cached top-of-stack into it when the
+  // stack is empty.
   class Stack {
   private:
-    std::vector<std::int64_t> data;
+    std::unique_ptr<std::int64_t[]> data;
+    std::int64_t *bottom;
+    std::int64_t *top;
+    std::int64_t *limit;
+
+    friend class Engine;
+    friend class Jit;
 
   public:
+    explicit Stack(std::size_t capacity);
     void push(std::int64_t number);
     std::int64_t pop();
     bool empty();
+    std::size_t size();
     void debug();
   };
+
+  struct Instruction {
+    enum class Op : std::uint8_t {
+      Number,
+      String,
+      Call,
+      TailCall,
+      Define,
+
+      Add,
+      Sub,
+      Mul,
+      Div,
+      Rem,
+      Mod,
+
+      More,
+      Less,
+      Equal,
+      NotEqual,
+
+      And,
+      Or,
+      Inv,
+
+      Emit,
+      Key,
+      Type,
+      Flush,
+      Accept,
+      ReadLine,
+      Slurp,
+
+      Dup,
+      Drop,
+      Swap,
+      Over,
+      Rot,
+
+      ToR,
+      RFrom,
+      RFetch,
+      I,
+      J,
+
+      Store,
+      Fetch,
+      CStore,
+      CFetch,
+      Alloc,
+      Free,
+      RegionAlloc,
+      RegionMark,
+      RegionRelease,
+      Strdup,
+      Move,
+      Fill,
+      Compare,
+      Scan,
+
+      DotS,
+      Bye,
+
+      AddLit,
+      MoreLit,
+      LessLit,
+      EqualLit,
+      NotEqualLit,
+      TwoDup,
+      TwoDrop,
+      Nip,
+      MinusRot,
+
+      Check,
+      Jump,
+      JumpIfZero,
+      JumpUnlessMoreLit,
+      JumpUnlessLessLit,
+      JumpUnlessEqualLit,
+      JumpUnlessNotEqualLit,
+      Do,
+      Loop,
+      PlusLoop,
+      Leave,
+      Return, // keep last, execute sizes its handler table by it
+    } op;
+    // Number, *Lit: the value; String: index into strings; Call, TailCall:
+    // index into words; Define: index into nestedDefinitions; Check:
+    // minimum depth in the low and growth in the high 32 bits; Jump*: offset
+    // relative to the jump itself in the low 32 bits and, for JumpUnless*Lit,
+    // the literal in the high 32 bits; Loop, PlusLoop, Leave: offset like
+    // Jump.
+    std::int64_t operand;
+#ifdef STACKER_THREADED
+    // Filled in by execute; code must not be rewritten once it has run.
+    const void *handler = nullptr;
+#endif
+  };
+  struct StackEffect {
+    std::int64_t in;
+    std::int64_t out;
+  };
+  struct Word {
+    std::string name;
+    std::size_t entry;
+    bool defined;
+    std::uint32_t calls = 0;
+    Jit::Function native = nullptr;
+  };
+  struct Frame {
+    std::size_t returnAddress;
+    std::size_t returnBase;
+  };
+  struct LoopFrame {
+    std::int64_t index;
+    std::int64_t limit;
+  };
+
+  Options options;
   Stack parameterStack;
   Stack returnStack;
+  // Depth of returnStack on entry to the running word; a word may only see
+  // and must leave behind what it pushed above this mark.
+  std::size_t returnBase = 0;
+  // Do loops entered and not yet left. execute keeps the innermost one in
+  // locals and only spills the loops around it here.
+  std::vector<LoopFrame> loops;
+  // Set by leave in the tree-walker until its do loop is reached.
+  bool leaving = false;
+  // Set by a tail call in the tree-walker to the body its caller runs next.
+  const std::vector<Expression> *tailCall = nullptr;
   std::map<std::string, std::vector<Expression>> dictionary;
-  std::set<std::uint8_t *> allocs;
+  Heap heap;
+  Region region;
+
+  std::vector<Instruction> code;
+#ifdef STACKER_THREADED
+  std::size_t threaded = 0;
+#endif
+  // String literals, pushed by address into the read-only pool.
+  LiteralPool literals;
+  std::vector<std::string_view> strings;
+  std::map<std::string_view, std::size_t> stringIndices;
+  std::vector<Word> words;
+  std::map<std::string, std::size_t> wordIndices;
+  // Definitions inside an if or a loop, made when control reaches them.
+  std::vector<Expression::WordDefinition> nestedDefinitions;
+  Jit jit;
+
+  // Check instruction of the block being lowered and the stack effect of the
+  // instructions emitted into it so far.
+  std::size_t blockCheck = 0;
+  std::int64_t blockDepth = 0;
+  std::int64_t blockNeed = 0;
+  std::int64_t blockGrow = 0;
+  // Leave jumps of each do loop being lowered, innermost last, patched once
+  // the end of the loop is known.
+  std::vector<std::vector<std::size_t>> leaveJumps;
 
-  void define(const std::string &word, const std::vector<Expression> &body);
-  bool evalBody(const std::vector<Expression> &body);
-  bool evalExpression(const Expression &expression);
+  void define(const std::string &word, std::vector<Expression> body);
+  std::int64_t allocate(std::int64_t size);
+  std::int64_t allocateCopy(std::string_view contents);
+  std::size_t intern(const std::string &str);
+  void release(std::int64_t addr);
+  std::int64_t allocateInRegion(std::int64_t size);
+  void releaseRegion(std::int64_t mark);
+  // tail is set when nothing in the word follows the code being evaluated.
+  bool evalBody(const std::vector<Expression> &body, bool tail = false);
+  bool evalExpression(const Expression &expression, bool tail = false);
+
+  static constexpr StackEffect stackEffect(Instruction::Op op);
+  std::size_t resolve(const std::string &word);
+  void emit(Instruction::Op op, std::int64_t operand = 0);
+  std::size_t emitJump(Instruction::Op op);
+  void patchJump(std::size_t jump, std::size_t target);
+  void startBlock();
+  bool returnsAt(std::size_t target);
+  void eliminateTailCalls(std::size_t entry);
+  void lowerBody(const std::vector<Expression> &body);
+  void lowerExpression(const Expression &expression);
+  bool execute(std::size_t entry);
+
+  friend class Jit;
 
 public:
-  Engine() = default;
+  Engine();
+  explicit Engine(const Options &options);
   void pushArgs(const std::vector<const char *> &args);
   ~Engine();
 
-  bool eval(std::istream &source);
+  bool eval(Lexer &source);
+  // Whether addr is inside a string literal.
+  bool isLiteral(const void *addr) const { return literals.contains(addr); }
+
+  // Writes out everything defined so far, tagged with the hash of the source
+  // it was evaluated from.
+  void writeImage(std::ostream &destination, std::uint64_t sourceHash);
+  // Restores definitions from an image written with the same options and
+  // source hash. Returns false, leaving the engine untouched, otherwise.
+  bool readImage(std::string_view image, std::uint64_t sourceHash);
 };
 
 #endif // ENGINE_HH
@@ -0,0 +1,51 @@
+#include "file.hh"
+
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.hh"
+
+MappedFile::MappedFile(const std::filesystem::path &path) {
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+    close(fd);
+    return;
+  }
+  // mmap rejects empty mappings, and an empty file needs none.
+  if (status.st_size > 0) {
+    void *mapping = mmap(nullptr, std::size_t(status.st_size), PROT_READ,
+                         MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      return;
+    }
+    data = mapping;
+    size = std::size_t(status.st_size);
+  }
+  close(fd);
+  open = true;
+}
+
+MappedFile::~MappedFile() {
+  if (data) {
+    munmap(data, size);
+  }
+}
+
+std::uint64_t executableId() {
+  struct stat status;
+  if (stat("/proc/self/exe", &status) != 0) {
+    return 0;
+  }
+  return fnv1a(std::to_string(status.st_size) + ":" +
+               std::to_string(status.st_mtim.tv_sec) + "." +
+               std::to_string(status.st_mtim.tv_nsec));
+}
@@ -0,0 +1,33 @@
+#ifndef FILE_HH
+#define FILE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+
+// A file mapped read-only into memory for the lifetime of the object.
+class MappedFile {
+private:
+  void *data = nullptr;
+  std::size_t size = 0;
+  bool open = false;
+
+public:
+  explicit MappedFile(const std::filesystem::path &path);
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile();
+
+  bool isOpen() const { return open; }
+  std::string_view contents() const {
+    return {static_cast<const char *>(data), size};
+  }
+};
+
+// Identifies the running stacker executable by its size and modification
+// time, so that images and binaries cached by one build of stacker are not
+// trusted by another. 0 if the executable cannot be found.
+std::uint64_t executableId();
+
+#endif // FILE_HH
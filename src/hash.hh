@@ -0,0 +1,19 @@
+#ifndef HASH_HH
+#define HASH_HH
+
+#include <cstdint>
+#include <string_view>
+
+constexpr std::uint64_t FNV1A_BASIS = 0xcbf29ce484222325;
+
+// 64-bit FNV-1a, continuing from hash so that several inputs can be chained.
+inline std::uint64_t fnv1a(std::string_view data,
+                           std::uint64_t hash = FNV1A_BASIS) {
+  for (const char c : data) {
+    hash ^= std::uint8_t(c);
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+#endif // HASH_HH
@@ -0,0 +1,188 @@
+#include "heap.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+Heap::~Heap() {
+  for (const std::uintptr_t slab : slabs) {
+    std::free(reinterpret_cast<void *>(slab));
+  }
+  for (const auto &[addr, size] : large) {
+    munmap(addr, size);
+  }
+}
+
+std::size_t Heap::sizeClass(std::size_t size) {
+  return size <= MIN_SMALL
+             ? 0
+             : std::bit_width(size - 1) - std::bit_width(MIN_SMALL - 1);
+}
+
+Heap::Slab *Heap::slabOf(const std::uint8_t *addr) {
+  return reinterpret_cast<Slab *>(reinterpret_cast<std::uintptr_t>(addr) &
+                                  ~(SLAB_SIZE - 1));
+}
+
+std::uint8_t *Heap::allocate(std::size_t size) {
+  if (size > MAX_SMALL) {
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    large.emplace(static_cast<std::uint8_t *>(addr), size);
+    ++liveBlocks;
+    return static_cast<std::uint8_t *>(addr);
+  }
+
+  std::uint8_t *const addr = allocateSmall(sizeClass(size));
+  const std::size_t bit = std::size_t(addr - reinterpret_cast<std::uint8_t *>(
+                                                 slabOf(addr))) /
+                          MIN_SMALL;
+  slabOf(addr)->used[bit / 64] |= std::uint64_t(1) << bit % 64;
+  ++liveBlocks;
+  return addr;
+}
+
+std::uint8_t *Heap::allocateSmall(std::size_t sizeClass) {
+  std::uint8_t *addr = freeBlocks[sizeClass];
+  if (addr) {
+    freeBlocks[sizeClass] = *reinterpret_cast<std::uint8_t **>(addr);
+    return addr;
+  }
+
+  const std::size_t blockSize = MIN_SMALL << sizeClass;
+  if (fresh[sizeClass] == freshEnd[sizeClass]) {
+    void *memory = std::aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if (!memory) {
+      throw std::bad_alloc();
+    }
+    slabs.insert(reinterpret_cast<std::uintptr_t>(memory));
+    Slab *const slab = new (memory) Slab{blockSize, {}};
+    const std::size_t first =
+        (sizeof(Slab) + blockSize - 1) / blockSize * blockSize;
+    fresh[sizeClass] = reinterpret_cast<std::uint8_t *>(slab) + first;
+    freshEnd[sizeClass] = reinterpret_cast<std::uint8_t *>(slab) + SLAB_SIZE;
+  }
+  addr = fresh[sizeClass];
+  fresh[sizeClass] += blockSize;
+  return addr;
+}
+
+bool Heap::release(std::uint8_t *addr) {
+  if (slabs.contains(reinterpret_cast<std::uintptr_t>(slabOf(addr)))) {
+    return releaseSmall(addr);
+  }
+
+  const auto &find = large.find(addr);
+  if (find == large.end()) {
+    return false;
+  }
+  munmap(find->first, find->second);
+  large.erase(find);
+  --liveBlocks;
+  return true;
+}
+
+bool Heap::releaseSmall(std::uint8_t *addr) {
+  Slab *const slab = slabOf(addr);
+  const std::size_t offset =
+      std::size_t(addr - reinterpret_cast<std::uint8_t *>(slab));
+  const std::size_t bit = offset / MIN_SMALL;
+  const std::uint64_t mask = std::uint64_t(1) << bit % 64;
+  if (offset % slab->blockSize != 0 || !(slab->used[bit / 64] & mask)) {
+    return false;
+  }
+  slab->used[bit / 64] &= ~mask;
+
+  const std::size_t sizeClass =
+      std::size_t(std::countr_zero(slab->blockSize / MIN_SMALL));
+  *reinterpret_cast<std::uint8_t **>(addr) = freeBlocks[sizeClass];
+  freeBlocks[sizeClass] = addr;
+  --liveBlocks;
+  return true;
+}
+
+std::uint8_t *Region::allocate(std::size_t size) {
+  size = (size + ALIGN - 1) / ALIGN * ALIGN;
+  while (current < chunks.size() && chunks[current].size - used < size) {
+    ++current;
+    used = 0;
+  }
+  if (current == chunks.size()) {
+    const std::size_t start =
+        chunks.empty() ? 0 : chunks.back().start + chunks.back().size;
+    const std::size_t chunkSize = std::max(size, CHUNK_SIZE);
+    chunks.push_back(
+        {std::make_unique_for_overwrite<std::uint8_t[]>(chunkSize), start,
+         chunkSize});
+  }
+  std::uint8_t *const addr = chunks[current].data.get() + used;
+  used += size;
+  return addr;
+}
+
+std::size_t Region::mark() const {
+  return current < chunks.size() ? chunks[current].start + used : 0;
+}
+
+bool Region::release(std::size_t mark) {
+  if (mark > this->mark()) {
+    return false;
+  }
+  if (chunks.empty()) {
+    return true;
+  }
+  // The last chunk starting at or before mark.
+  const auto chunk =
+      std::upper_bound(chunks.begin(), chunks.begin() + current + 1, mark,
+                       [](std::size_t mark, const Chunk &chunk) {
+                         return mark < chunk.start;
+                       }) -
+      1;
+  current = std::size_t(chunk - chunks.begin());
+  used = mark - chunk->start;
+  return true;
+}
+
+LiteralPool::~LiteralPool() {
+  for (const Chunk &chunk : chunks) {
+    munmap(chunk.data, chunk.size);
+  }
+}
+
+std::string_view LiteralPool::add(std::string_view str) {
+  if (chunks.empty() || chunks.back().size - used < str.size()) {
+    const std::size_t page = std::size_t(sysconf(_SC_PAGESIZE));
+    const std::size_t size =
+        std::max(CHUNK_SIZE, (str.size() + page - 1) / page * page);
+    void *data =
+        mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    chunks.push_back({static_cast<std::uint8_t *>(data), size});
+    used = 0;
+  }
+  const Chunk &chunk = chunks.back();
+  const char *const start = reinterpret_cast<const char *>(chunk.data + used);
+  if (!str.empty()) {
+    mprotect(chunk.data, chunk.size, PROT_READ | PROT_WRITE);
+    std::memcpy(chunk.data + used, str.data(), str.size());
+    mprotect(chunk.data, chunk.size, PROT_READ);
+    used += str.size();
+  }
+  return {start, str.size()};
+}
+
+bool LiteralPool::contains(const void *addr) const {
+  const std::uint8_t *const byte = static_cast<const std::uint8_t *>(addr);
+  return std::any_of(chunks.begin(), chunks.end(), [byte](const Chunk &chunk) {
+    return std::less_equal<>()(chunk.data, byte) &&
+           std::less<>()(byte, chunk.data + chunk.size);
+  });
+}
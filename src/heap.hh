@@ -0,0 +1,111 @@
+#ifndef HEAP_HH
+#define HEAP_HH
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Memory handed out by alloc. Blocks up to MAX_SMALL bytes come from slabs
+// of one power-of-two size class each, larger ones are mapped on their own.
+// release recognizes exactly the live blocks it handed out, in constant time,
+// so that free can reject anything else.
+class Heap {
+private:
+  static constexpr std::size_t SLAB_SIZE = std::size_t(1) << 18;
+  static constexpr std::size_t MIN_SMALL = 16;
+  static constexpr std::size_t MAX_SMALL = std::size_t(1) << 14;
+  static constexpr std::size_t CLASS_COUNT =
+      std::bit_width(MAX_SMALL) - std::bit_width(MIN_SMALL) + 1;
+
+  // Lives at the start of its SLAB_SIZE-aligned slab, with the blocks
+  // following it. used has a bit per MIN_SMALL bytes of the slab, set at the
+  // start of each live block.
+  struct Slab {
+    std::size_t blockSize;
+    std::uint64_t used[SLAB_SIZE / MIN_SMALL / 64];
+  };
+
+  std::unordered_set<std::uintptr_t> slabs;
+  std::unordered_map<std::uint8_t *, std::size_t> large;
+  // Free blocks of each class, linked through their first bytes.
+  std::uint8_t *freeBlocks[CLASS_COUNT] = {};
+  // Never used part of the newest slab of each class.
+  std::uint8_t *fresh[CLASS_COUNT] = {};
+  std::uint8_t *freshEnd[CLASS_COUNT] = {};
+  std::size_t liveBlocks = 0;
+
+  static std::size_t sizeClass(std::size_t size);
+  static Slab *slabOf(const std::uint8_t *addr);
+  std::uint8_t *allocateSmall(std::size_t sizeClass);
+  bool releaseSmall(std::uint8_t *addr);
+
+public:
+  Heap() = default;
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+  ~Heap();
+
+  // size must be positive.
+  std::uint8_t *allocate(std::size_t size);
+  // Returns false, leaving the heap untouched, unless addr is a live block.
+  bool release(std::uint8_t *addr);
+  std::size_t live() const { return liveBlocks; }
+};
+
+// Memory handed out by region-alloc, bumped out of chunks and given back in
+// bulk by rewinding to an earlier mark. Chunks are kept for reuse once
+// allocated. A mark is the number of chunk bytes before the next allocation,
+// counting any skipped at the end of a chunk.
+class Region {
+private:
+  static constexpr std::size_t CHUNK_SIZE = std::size_t(1) << 16;
+  static constexpr std::size_t ALIGN = 16;
+
+  struct Chunk {
+    std::unique_ptr<std::uint8_t[]> data;
+    std::size_t start;
+    std::size_t size;
+  };
+  std::vector<Chunk> chunks;
+  std::size_t current = 0;
+  std::size_t used = 0;
+
+public:
+  // size must be positive.
+  std::uint8_t *allocate(std::size_t size);
+  std::size_t mark() const;
+  // Returns false, leaving the region untouched, unless mark is at or before
+  // the current one.
+  bool release(std::size_t mark);
+};
+
+// String literals, copied into mapped chunks that stay read-only except
+// while a literal is being added, so that a store into one faults instead of
+// changing every use of it. Literals never move.
+class LiteralPool {
+private:
+  static constexpr std::size_t CHUNK_SIZE = std::size_t(1) << 16;
+
+  struct Chunk {
+    std::uint8_t *data;
+    std::size_t size;
+  };
+  std::vector<Chunk> chunks;
+  std::size_t used = 0;
+
+public:
+  LiteralPool() = default;
+  LiteralPool(const LiteralPool &) = delete;
+  LiteralPool &operator=(const LiteralPool &) = delete;
+  ~LiteralPool();
+
+  std::string_view add(std::string_view str);
+  bool contains(const void *addr) const;
+};
+
+#endif // HEAP_HH
@@ -0,0 +1,316 @@
+#include "engine.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "file.hh"
+#include "parser.hh"
+
+namespace {
+
+constexpr std::string_view MAGIC = "stkimg01";
+
+// Bumped whenever the bytecode or the image layout changes. Images also
+// record the executableId of the stacker that wrote them, which catches
+// changes nobody remembered to bump this for.
+constexpr std::uint64_t FORMAT_VERSION = 2;
+
+// Images record how many opcodes and expression types the stacker that wrote
+// them knew, so that images from an older stacker are rejected rather than
+// misread.
+constexpr std::uint64_t TYPE_COUNT =
+    std::uint64_t(Expression::Type::Leave) + 1;
+
+class ImageWriter {
+private:
+  std::ostream &destination;
+
+public:
+  explicit ImageWriter(std::ostream &destination) : destination(destination) {}
+
+  void u8(std::uint8_t value) { destination.put(char(value)); }
+  void i64(std::int64_t value) {
+    destination.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+  void string(std::string_view value) {
+    i64(std::int64_t(value.size()));
+    destination.write(value.data(), std::streamsize(value.size()));
+  }
+  void body(const std::vector<Expression> &body) {
+    i64(std::int64_t(body.size()));
+    for (const Expression &expression : body) {
+      this->expression(expression);
+    }
+  }
+  void expression(const Expression &expression) {
+    u8(std::uint8_t(expression.type));
+    u8(std::uint8_t(expression.data.index()));
+    switch (expression.data.index()) {
+    case 1:
+      i64(std::get<std::int64_t>(expression.data));
+      break;
+    case 2:
+      string(std::get<std::string>(expression.data));
+      break;
+    case 3:
+      body(std::get<std::vector<Expression>>(expression.data));
+      break;
+    case 4: {
+      const auto &definition =
+          std::get<Expression::WordDefinition>(expression.data);
+      string(definition.word);
+      body(definition.body);
+    } break;
+    case 5: {
+      const auto &beginWhile =
+          std::get<Expression::BeginWhile>(expression.data);
+      body(beginWhile.condBody);
+      body(beginWhile.whileBody);
+    } break;
+    case 6: {
+      const auto &ifElse = std::get<Expression::IfElse>(expression.data);
+      body(ifElse.ifBody);
+      body(ifElse.elseBody);
+    } break;
+    default:
+      break;
+    }
+  }
+};
+
+// Reads from an image in place. Every read past the end or of an
+// out-of-range value clears ok and yields zeroes from then on.
+class ImageReader {
+private:
+  std::string_view image;
+
+public:
+  bool ok = true;
+
+  explicit ImageReader(std::string_view image) : image(image) {}
+
+  bool atEnd() const { return image.empty(); }
+  std::string_view bytes(std::size_t size) {
+    if (!ok || image.size() < size) {
+      ok = false;
+      return {};
+    }
+    const std::string_view result = image.substr(0, size);
+    image.remove_prefix(size);
+    return result;
+  }
+  std::uint8_t u8() {
+    const std::string_view b = bytes(1);
+    return ok ? std::uint8_t(b[0]) : 0;
+  }
+  std::int64_t i64() {
+    std::int64_t value = 0;
+    const std::string_view b = bytes(sizeof(value));
+    if (ok) {
+      std::memcpy(&value, b.data(), sizeof(value));
+    }
+    return value;
+  }
+  std::size_t size() {
+    const std::int64_t value = i64();
+    if (value < 0 || std::uint64_t(value) > image.size()) {
+      ok = false;
+      return 0;
+    }
+    return std::size_t(value);
+  }
+  std::string string() { return std::string(bytes(size())); }
+  std::vector<Expression> body() {
+    std::vector<Expression> body(size());
+    for (Expression &expression : body) {
+      expression = this->expression();
+    }
+    return body;
+  }
+  Expression expression() {
+    const std::uint8_t type = u8();
+    if (type >= TYPE_COUNT) {
+      ok = false;
+    }
+    Expression expression{Expression::Type(type), std::monostate()};
+    switch (u8()) {
+    case 0:
+      break;
+    case 1:
+      expression.data = i64();
+      break;
+    case 2:
+      expression.data = string();
+      break;
+    case 3:
+      expression.data = body();
+      break;
+    case 4: {
+      std::string word = string();
+      expression.data = Expression::WordDefinition{std::move(word), body()};
+    } break;
+    case 5: {
+      std::vector<Expression> condBody = body();
+      expression.data = Expression::BeginWhile{std::move(condBody), body()};
+    } break;
+    case 6: {
+      std::vector<Expression> ifBody = body();
+      expression.data = Expression::IfElse{std::move(ifBody), body()};
+    } break;
+    default:
+      ok = false;
+      break;
+    }
+    return expression;
+  }
+};
+
+std::uint8_t imageFlags(const Engine::Options &options) {
+  return std::uint8_t(options.treeWalker) | std::uint8_t(options.inlining) << 1;
+}
+
+} // namespace
+
+void Engine::writeImage(std::ostream &destination, std::uint64_t sourceHash) {
+  constexpr std::uint64_t OP_COUNT = std::uint64_t(Instruction::Op::Return) + 1;
+  ImageWriter writer{destination};
+  destination.write(MAGIC.data(), MAGIC.size());
+  writer.i64(std::int64_t(sourceHash));
+  writer.i64(std::int64_t(FORMAT_VERSION));
+  writer.i64(std::int64_t(executableId()));
+  writer.u8(imageFlags(options));
+  writer.i64(OP_COUNT);
+  writer.i64(TYPE_COUNT);
+
+  writer.i64(std::int64_t(strings.size()));
+  for (const std::string_view str : strings) {
+    writer.string(str);
+  }
+  writer.i64(std::int64_t(words.size()));
+  for (const Word &word : words) {
+    writer.string(word.name);
+    writer.i64(std::int64_t(word.entry));
+    writer.u8(word.defined);
+  }
+  writer.i64(std::int64_t(code.size()));
+  for (const Instruction &instruction : code) {
+    writer.u8(std::uint8_t(instruction.op));
+    writer.i64(instruction.operand);
+  }
+  writer.i64(std::int64_t(dictionary.size()));
+  for (const auto &[word, body] : dictionary) {
+    writer.string(word);
+    writer.body(body);
+  }
+  writer.i64(std::int64_t(nestedDefinitions.size()));
+  for (const Expression::WordDefinition &definition : nestedDefinitions) {
+    writer.string(definition.word);
+    writer.body(definition.body);
+  }
+}
+
+bool Engine::readImage(std::string_view image, std::uint64_t sourceHash) {
+  constexpr std::uint64_t OP_COUNT = std::uint64_t(Instruction::Op::Return) + 1;
+  ImageReader reader{image};
+  if (reader.bytes(MAGIC.size()) != MAGIC ||
+      std::uint64_t(reader.i64()) != sourceHash ||
+      std::uint64_t(reader.i64()) != FORMAT_VERSION ||
+      std::uint64_t(reader.i64()) != executableId() ||
+      reader.u8() != imageFlags(options) ||
+      std::uint64_t(reader.i64()) != OP_COUNT ||
+      std::uint64_t(reader.i64()) != TYPE_COUNT) {
+    return false;
+  }
+
+  std::vector<std::string> imageStrings(reader.size());
+  for (std::string &str : imageStrings) {
+    str = reader.string();
+  }
+  std::vector<Word> imageWords(reader.size());
+  for (Word &word : imageWords) {
+    word.name = reader.string();
+    word.entry = std::size_t(reader.i64());
+    word.defined = reader.u8();
+  }
+  std::vector<Instruction> imageCode(reader.size());
+  for (std::size_t i = 0; i < imageCode.size(); ++i) {
+    Instruction &instruction = imageCode[i];
+    const std::uint8_t op = reader.u8();
+    instruction.op = Instruction::Op(op);
+    instruction.operand = reader.i64();
+    switch (instruction.op) {
+    case Instruction::Op::Check:
+      reader.ok &= instruction.operand >= 0;
+      break;
+    case Instruction::Op::Jump:
+    case Instruction::Op::JumpIfZero:
+    case Instruction::Op::JumpUnlessMoreLit:
+    case Instruction::Op::JumpUnlessLessLit:
+    case Instruction::Op::JumpUnlessEqualLit:
+    case Instruction::Op::JumpUnlessNotEqualLit:
+    case Instruction::Op::Loop:
+    case Instruction::Op::PlusLoop:
+    case Instruction::Op::Leave: {
+      const std::int64_t target =
+          std::int64_t(i) + std::int32_t(instruction.operand);
+      reader.ok &= target >= 0 && std::uint64_t(target) < imageCode.size();
+    } break;
+    case Instruction::Op::String:
+      reader.ok &= std::uint64_t(instruction.operand) < imageStrings.size();
+      break;
+    case Instruction::Op::Call:
+    case Instruction::Op::TailCall:
+      reader.ok &= std::uint64_t(instruction.operand) < imageWords.size();
+      break;
+    default:
+      reader.ok &= op < OP_COUNT;
+      break;
+    }
+  }
+  for (const Word &word : imageWords) {
+    reader.ok &= !word.defined || word.entry < imageCode.size();
+  }
+  std::map<std::string, std::vector<Expression>> imageDictionary;
+  for (std::size_t count = reader.size(); count > 0; --count) {
+    std::string word = reader.string();
+    imageDictionary[std::move(word)] = reader.body();
+  }
+  std::vector<Expression::WordDefinition> imageNestedDefinitions(
+      reader.size());
+  for (Expression::WordDefinition &definition : imageNestedDefinitions) {
+    definition.word = reader.string();
+    definition.body = reader.body();
+  }
+  for (const Instruction &instruction : imageCode) {
+    reader.ok &= instruction.op != Instruction::Op::Define ||
+                 std::uint64_t(instruction.operand) <
+                     imageNestedDefinitions.size();
+  }
+  if (!reader.ok || !reader.atEnd()) {
+    return false;
+  }
+
+  strings.clear();
+  stringIndices.clear();
+  for (const std::string &str : imageStrings) {
+    strings.push_back(literals.add(str));
+    stringIndices.emplace(strings.back(), strings.size() - 1);
+  }
+  words = std::move(imageWords);
+  wordIndices.clear();
+  for (std::size_t i = 0; i < words.size(); ++i) {
+    wordIndices[words[i].name] = i;
+  }
+  code = std::move(imageCode);
+  dictionary = std::move(imageDictionary);
+  nestedDefinitions = std::move(imageNestedDefinitions);
+  return true;
+}
@@ -0,0 +1,554 @@
+#include "jit.hh"
+
+#include "engine.hh"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <cstddef>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+enum Register : std::uint8_t {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RSI = 6,
+  RDI = 7,
+  R8 = 8,
+  R9 = 9,
+  R10 = 10,
+  R11 = 11,
+};
+
+enum Condition : std::uint8_t {
+  Above = 0x7,
+  Equal = 0x4,
+  NotEqual = 0x5,
+  Less = 0xc,
+  GreaterEqual = 0xd,
+  LessEqual = 0xe,
+  Greater = 0xf,
+};
+
+// Code is generated against a fixed assignment: rax caches the top of the
+// stack, rdi is the spill slot, rsi the floor and r9 the highest slot the
+// stack may grow to; r10 and r11 are the top and base of the return stack
+// and r8 points at the Jit::State. rcx and rdx are scratch.
+class Assembler {
+private:
+  std::vector<std::uint8_t> bytes;
+
+  void rex(std::uint8_t reg, std::uint8_t rm) {
+    byte(0x48 | (reg >> 3) << 2 | rm >> 3);
+  }
+
+public:
+  const std::vector<std::uint8_t> &code() const { return bytes; }
+  std::size_t size() const { return bytes.size(); }
+
+  void byte(std::uint8_t b) { bytes.push_back(b); }
+  void int32(std::int32_t i) {
+    for (int shift = 0; shift < 32; shift += 8) {
+      byte(std::uint8_t(i >> shift));
+    }
+  }
+  void int64(std::int64_t i) {
+    for (int shift = 0; shift < 64; shift += 8) {
+      byte(std::uint8_t(i >> shift));
+    }
+  }
+
+  // op reg, [base + disp]
+  void memory(std::uint8_t op, std::uint8_t reg, std::uint8_t base,
+              std::int8_t disp) {
+    rex(reg, base);
+    byte(op);
+    byte(0x40 | (reg & 7) << 3 | (base & 7));
+    byte(std::uint8_t(disp));
+  }
+  void load(std::uint8_t reg, std::uint8_t base, std::int8_t disp = 0) {
+    memory(0x8b, reg, base, disp);
+  }
+  void store(std::uint8_t base, std::int8_t disp, std::uint8_t reg) {
+    memory(0x89, reg, base, disp);
+  }
+
+  // op rm, reg
+  void registers(std::uint8_t op, std::uint8_t rm, std::uint8_t reg) {
+    rex(reg, rm);
+    byte(op);
+    byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+  }
+  void move(std::uint8_t to, std::uint8_t from) { registers(0x89, to, from); }
+
+  // op rm, imm with op the /digit of the 0x81 group
+  void immediate(std::uint8_t op, std::uint8_t rm, std::int32_t imm) {
+    rex(0, rm);
+    if (imm == std::int8_t(imm)) {
+      byte(0x83);
+      byte(0xc0 | op << 3 | (rm & 7));
+      byte(std::uint8_t(imm));
+    } else {
+      byte(0x81);
+      byte(0xc0 | op << 3 | (rm & 7));
+      int32(imm);
+    }
+  }
+  void add(std::uint8_t rm, std::int32_t imm) { immediate(0, rm, imm); }
+  void sub(std::uint8_t rm, std::int32_t imm) { immediate(5, rm, imm); }
+  void compare(std::uint8_t rm, std::int32_t imm) { immediate(7, rm, imm); }
+
+  void moveImmediate(std::uint8_t reg, std::int64_t imm) {
+    rex(0, reg);
+    byte(0xb8 | (reg & 7));
+    int64(imm);
+  }
+
+  // rax = condition ? -1 : 0, from the flags
+  void setFlag(Condition condition) {
+    byte(0x0f);
+    byte(0x90 | condition);
+    byte(0xc0);
+    byte(0x0f);
+    byte(0xb6);
+    byte(0xc0);
+    byte(0x48);
+    byte(0xf7);
+    byte(0xd8);
+  }
+
+  // Returns the offset of the rel32 to patch.
+  std::size_t jump() {
+    byte(0xe9);
+    int32(0);
+    return bytes.size() - 4;
+  }
+  std::size_t jump(Condition condition) {
+    byte(0x0f);
+    byte(0x80 | condition);
+    int32(0);
+    return bytes.size() - 4;
+  }
+  void patch(std::size_t at, std::size_t target) {
+    const std::int32_t rel = std::int32_t(target - (at + 4));
+    std::memcpy(bytes.data() + at, &rel, sizeof(rel));
+  }
+};
+
+struct Fixup {
+  std::size_t at;
+  std::size_t target;
+};
+
+} // namespace
+
+Jit::~Jit() {
+  for (const auto &[memory, size] : regions) {
+    munmap(memory, size);
+  }
+}
+
+Jit::Function Jit::compile(const Engine &engine, std::size_t word) {
+  using Op = Engine::Instruction::Op;
+  const std::vector<Engine::Instruction> &code = engine.code;
+  const std::size_t entry = engine.words[word].entry;
+
+  std::size_t end = entry;
+  while (code[end].op != Op::Return) {
+    switch (code[end].op) {
+    case Op::Number:
+    case Op::Add:
+    case Op::Sub:
+    case Op::Mul:
+    case Op::Div:
+    case Op::Rem:
+    case Op::Mod:
+    case Op::More:
+    case Op::Less:
+    case Op::Equal:
+    case Op::NotEqual:
+    case Op::And:
+    case Op::Or:
+    case Op::Inv:
+    case Op::Dup:
+    case Op::Drop:
+    case Op::Swap:
+    case Op::Over:
+    case Op::Rot:
+    case Op::ToR:
+    case Op::RFrom:
+    case Op::RFetch:
+    case Op::Store:
+    case Op::Fetch:
+    case Op::CStore:
+    case Op::CFetch:
+    case Op::AddLit:
+    case Op::MoreLit:
+    case Op::LessLit:
+    case Op::EqualLit:
+    case Op::NotEqualLit:
+    case Op::TwoDup:
+    case Op::TwoDrop:
+    case Op::Nip:
+    case Op::MinusRot:
+    case Op::Check:
+    case Op::Jump:
+    case Op::JumpIfZero:
+    case Op::JumpUnlessMoreLit:
+    case Op::JumpUnlessLessLit:
+    case Op::JumpUnlessEqualLit:
+    case Op::JumpUnlessNotEqualLit:
+      break;
+    case Op::TailCall:
+      if (std::size_t(code[end].operand) != word) {
+        return nullptr;
+      }
+      break;
+    default:
+      return nullptr;
+    }
+    ++end;
+  }
+
+  Assembler a;
+  std::vector<std::size_t> offsets(end - entry + 1);
+  std::vector<Fixup> jumps;
+  std::vector<std::pair<std::size_t, Status>> errors;
+
+  a.move(R8, RDI);
+  a.load(RDI, R8, offsetof(State, sp));
+  a.load(RSI, R8, offsetof(State, floor));
+  a.load(R9, R8, offsetof(State, limit));
+  a.load(R10, R8, offsetof(State, returnTop));
+  a.load(R11, R8, offsetof(State, returnBase));
+  a.load(RAX, RDI);
+
+  // rcx = second of stack
+  const auto popSecond = [&a]() {
+    a.sub(RDI, 8);
+    a.load(RCX, RDI);
+  };
+  const auto pushTos = [&a]() {
+    a.store(RDI, 0, RAX);
+    a.add(RDI, 8);
+  };
+  const auto literal = [&a](std::int64_t value) {
+    if (value == std::int32_t(value)) {
+      a.compare(RAX, std::int32_t(value));
+    } else {
+      a.moveImmediate(RCX, value);
+      a.registers(0x39, RAX, RCX);
+    }
+  };
+  const auto divide = [&a, &popSecond]() {
+    popSecond();
+    a.registers(0x87, RAX, RCX); // xchg
+    a.byte(0x48); // cqo
+    a.byte(0x99);
+    a.byte(0x48); // idiv rcx
+    a.byte(0xf7);
+    a.byte(0xf9);
+  };
+  const auto checkReturnBalanced = [&a, &errors]() {
+    a.registers(0x39, R10, R11);
+    errors.emplace_back(a.jump(NotEqual), Status::UnbalancedReturnStack);
+  };
+  const auto checkReturnNotEmpty = [&a, &errors]() {
+    a.registers(0x39, R10, R11);
+    errors.emplace_back(a.jump(Equal), Status::EmptyReturnStack);
+  };
+
+  for (std::size_t i = entry; i <= end; ++i) {
+    const Engine::Instruction &instruction = code[i];
+    const std::int64_t operand = instruction.operand;
+    offsets[i - entry] = a.size();
+
+    switch (instruction.op) {
+    case Op::Number:
+      pushTos();
+      a.moveImmediate(RAX, operand);
+      break;
+
+    case Op::Add:
+      a.sub(RDI, 8);
+      a.memory(0x03, RAX, RDI, 0);
+      break;
+    case Op::Sub:
+      popSecond();
+      a.registers(0x29, RCX, RAX);
+      a.move(RAX, RCX);
+      break;
+    case Op::Mul:
+      a.sub(RDI, 8);
+      a.byte(0x48);
+      a.byte(0x0f);
+      a.byte(0xaf);
+      a.byte(0x47);
+      a.byte(0x00);
+      break;
+    case Op::Div:
+      divide();
+      break;
+    case Op::Rem:
+      divide();
+      a.move(RAX, RDX);
+      break;
+    case Op::Mod:
+      divide();
+      a.move(RAX, RDX);
+      a.registers(0x01, RAX, RCX);
+      a.byte(0x48);
+      a.byte(0x99);
+      a.byte(0x48);
+      a.byte(0xf7);
+      a.byte(0xf9);
+      a.move(RAX, RDX);
+      break;
+
+    case Op::More:
+      a.sub(RDI, 8);
+      a.memory(0x39, RAX, RDI, 0);
+      a.setFlag(Greater);
+      break;
+    case Op::Less:
+      a.sub(RDI, 8);
+      a.memory(0x39, RAX, RDI, 0);
+      a.setFlag(Less);
+      break;
+    case Op::Equal:
+      a.sub(RDI, 8);
+      a.memory(0x39, RAX, RDI, 0);
+      a.setFlag(Equal);
+      break;
+    case Op::NotEqual:
+      a.sub(RDI, 8);
+      a.memory(0x39, RAX, RDI, 0);
+      a.setFlag(NotEqual);
+      break;
+
+    case Op::And:
+      a.sub(RDI, 8);
+      a.memory(0x23, RAX, RDI, 0);
+      break;
+    case Op::Or:
+      a.sub(RDI, 8);
+      a.memory(0x0b, RAX, RDI, 0);
+      break;
+    case Op::Inv:
+      a.byte(0x48);
+      a.byte(0xf7);
+      a.byte(0xd0);
+      break;
+
+    case Op::Dup:
+      pushTos();
+      break;
+    case Op::Drop:
+      a.sub(RDI, 8);
+      a.load(RAX, RDI);
+      break;
+    case Op::Swap:
+      a.load(RCX, RDI, -8);
+      a.store(RDI, -8, RAX);
+      a.move(RAX, RCX);
+      break;
+    case Op::Over:
+      a.load(RCX, RDI, -8);
+      pushTos();
+      a.move(RAX, RCX);
+      break;
+    case Op::Rot:
+      a.load(RCX, RDI, -16);
+      a.load(RDX, RDI, -8);
+      a.store(RDI, -16, RDX);
+      a.store(RDI, -8, RAX);
+      a.move(RAX, RCX);
+      break;
+
+    case Op::ToR:
+      a.memory(0x3b, R10, R8, offsetof(State, returnLimit));
+      errors.emplace_back(a.jump(Equal), Status::StackOverflow);
+      a.store(R10, 0, RAX);
+      a.add(R10, 8);
+      a.sub(RDI, 8);
+      a.load(RAX, RDI);
+      break;
+    case Op::RFrom:
+      checkReturnNotEmpty();
+      pushTos();
+      a.sub(R10, 8);
+      a.load(RAX, R10);
+      break;
+    case Op::RFetch:
+      checkReturnNotEmpty();
+      pushTos();
+      a.load(RAX, R10, -8);
+      break;
+
+    case Op::Store:
+      a.load(RCX, RDI, -8);
+      a.store(RAX, 0, RCX);
+      a.load(RAX, RDI, -16);
+      a.sub(RDI, 16);
+      break;
+    case Op::Fetch:
+      a.load(RAX, RAX);
+      break;
+    case Op::CStore:
+      a.load(RCX, RDI, -8);
+      a.byte(0x88); // mov [rax], cl
+      a.byte(0x08);
+      a.load(RAX, RDI, -16);
+      a.sub(RDI, 16);
+      break;
+    case Op::CFetch:
+      a.byte(0x48); // movsx rax, byte [rax]
+      a.byte(0x0f);
+      a.byte(0xbe);
+      a.byte(0x00);
+      break;
+
+    case Op::AddLit:
+      if (operand == std::int32_t(operand)) {
+        a.add(RAX, std::int32_t(operand));
+      } else {
+        a.moveImmediate(RCX, operand);
+        a.registers(0x01, RAX, RCX);
+      }
+      break;
+    case Op::MoreLit:
+      literal(operand);
+      a.setFlag(Greater);
+      break;
+    case Op::LessLit:
+      literal(operand);
+      a.setFlag(Less);
+      break;
+    case Op::EqualLit:
+      literal(operand);
+      a.setFlag(Equal);
+      break;
+    case Op::NotEqualLit:
+      literal(operand);
+      a.setFlag(NotEqual);
+      break;
+    case Op::TwoDup:
+      a.load(RCX, RDI, -8);
+      a.store(RDI, 0, RAX);
+      a.store(RDI, 8, RCX);
+      a.add(RDI, 16);
+      break;
+    case Op::TwoDrop:
+      a.load(RAX, RDI, -16);
+      a.sub(RDI, 16);
+      break;
+    case Op::Nip:
+      a.sub(RDI, 8);
+      break;
+    case Op::MinusRot:
+      a.load(RCX, RDI, -16);
+      a.load(RDX, RDI, -8);
+      a.store(RDI, -16, RAX);
+      a.store(RDI, -8, RCX);
+      a.move(RAX, RDX);
+      break;
+
+    case Op::Check: {
+      const std::int32_t need = std::int32_t(operand & 0xffffffff);
+      const std::int32_t grow = std::int32_t(operand >> 32);
+      if (need > 0) {
+        a.move(RCX, RDI);
+        a.registers(0x29, RCX, RSI);
+        a.compare(RCX, need * 8);
+        errors.emplace_back(a.jump(Less), Status::EmptyStack);
+      }
+      if (grow > 0) {
+        a.byte(0x48); // lea rcx, [rdi + grow * 8]
+        a.byte(0x8d);
+        a.byte(0x8f);
+        a.int32(grow * 8);
+        a.registers(0x39, RCX, R9);
+        errors.emplace_back(a.jump(Above), Status::StackOverflow);
+      }
+    } break;
+    case Op::Jump:
+      jumps.push_back({a.jump(), i + std::int32_t(operand)});
+      break;
+    case Op::JumpIfZero:
+      a.move(RCX, RAX);
+      a.sub(RDI, 8);
+      a.load(RAX, RDI);
+      a.registers(0x85, RCX, RCX);
+      jumps.push_back({a.jump(Equal), i + std::int32_t(operand)});
+      break;
+    case Op::JumpUnlessMoreLit:
+    case Op::JumpUnlessLessLit:
+    case Op::JumpUnlessEqualLit:
+    case Op::JumpUnlessNotEqualLit: {
+      a.move(RCX, RAX);
+      a.sub(RDI, 8);
+      a.load(RAX, RDI);
+      a.compare(RCX, std::int32_t(operand >> 32));
+      const Condition unless =
+          instruction.op == Op::JumpUnlessMoreLit   ? LessEqual
+          : instruction.op == Op::JumpUnlessLessLit ? GreaterEqual
+          : instruction.op == Op::JumpUnlessEqualLit ? NotEqual
+                                                     : Equal;
+      jumps.push_back({a.jump(unless), i + std::int32_t(operand)});
+    } break;
+
+    case Op::TailCall:
+      checkReturnBalanced();
+      jumps.push_back({a.jump(), entry});
+      break;
+    case Op::Return:
+      checkReturnBalanced();
+      a.store(RDI, 0, RAX);
+      a.store(R8, offsetof(State, sp), RDI);
+      a.store(R8, offsetof(State, returnTop), R10);
+      a.byte(0x31); // xor eax, eax
+      a.byte(0xc0);
+      a.byte(0xc3); // ret
+      break;
+
+    default:
+      return nullptr;
+    }
+  }
+
+  for (const Fixup &fixup : jumps) {
+    a.patch(fixup.at, offsets[fixup.target - entry]);
+  }
+  for (const auto &[at, status] : errors) {
+    a.patch(at, a.size());
+    a.byte(0xb8); // mov eax, status
+    a.int32(std::int32_t(status));
+    a.byte(0xc3);
+  }
+
+  const std::size_t page = sysconf(_SC_PAGESIZE);
+  const std::size_t size = (a.size() + page - 1) / page * page;
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+  std::memcpy(memory, a.code().data(), a.size());
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return nullptr;
+  }
+  regions.emplace_back(memory, size);
+  return reinterpret_cast<Function>(memory);
+}
+
+#else
+
+Jit::~Jit() {}
+
+Jit::Function Jit::compile(const Engine &, std::size_t) { return nullptr; }
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef JIT_HH
+#define JIT_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+class Engine;
+
+// Translates the bytecode of leaf words to x86-64 machine code. On other
+// platforms, and for words using anything beyond arithmetic, stack, memory
+// and branch instructions, compile returns nullptr and the word stays
+// interpreted.
+class Jit {
+public:
+  enum class Status : std::int64_t {
+    Ok,
+    EmptyStack,
+    StackOverflow,
+    EmptyReturnStack,
+    UnbalancedReturnStack,
+  };
+  // Machine state of Engine::execute, read on entry and, on success,
+  // written back on exit. sp is the spill slot of the cached top of stack.
+  struct State {
+    std::int64_t *sp;
+    std::int64_t *floor;
+    std::int64_t *limit;
+    std::int64_t *returnTop;
+    std::int64_t *returnBase;
+    std::int64_t *returnLimit;
+  };
+  using Function = Status (*)(State *state);
+
+private:
+  std::vector<std::pair<void *, std::size_t>> regions;
+
+public:
+  Jit() = default;
+  Jit(const Jit &) = delete;
+  Jit &operator=(const Jit &) = delete;
+  ~Jit();
+
+  Function compile(const Engine &engine, std::size_t word);
+};
+
+#endif // JIT_HH
@@ -1,27 +1,18 @@
 #include "lexer.hh"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <iostream>
-#include <map>
+#include <iterator>
 #include <optional>
+#include <string_view>
 
 bool isDec(int ch);
 std::int64_t toDec(int ch);
 bool isSpace(int ch);
 
-Lexeme lexNum(std::istream &source, std::string &word, std::int64_t sign,
-              std::int64_t mag);
-Lexeme lexSign(std::istream &source, std::string &word, std::int64_t sign);
-
-char lexEscape(std::istream &source);
-Lexeme lexChar(std::istream &source);
-Lexeme lexStr(std::istream &source, std::string &str);
-
-Lexeme lexWordDone(const std::string &word);
-Lexeme lexWord(std::istream &source, std::string &word);
-
-Lexeme lexChar(int ch, std::istream &source);
+Lexeme lexWordDone(std::string_view word);
 
 bool isSpace(int ch) {
   return ch == EOF || ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
@@ -30,8 +21,22 @@ bool isSpace(int ch) {
 bool isDec(int ch) { return '0' <= ch && ch <= '9'; }
 std::int64_t toDec(int ch) { return ch - '0'; }
 
-char lexEscape(std::istream &source) {
-  const int ch = source.get();
+Lexer::Lexer(std::istream &source) : stream(&source) {}
+
+Lexer::Lexer(std::string_view source) : buffer(source) {}
+
+int Lexer::get() {
+  if (stream) {
+    return stream->get();
+  }
+  if (position < buffer.size()) {
+    return std::uint8_t(buffer[position++]);
+  }
+  return EOF;
+}
+
+char Lexer::lexEscape() {
+  const int ch = get();
 
   if (ch == EOF) {
     std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected EOF\n";
@@ -47,15 +52,12 @@ char lexEscape(std::istream &source) {
   if (ch == 't') {
     return '\t';
   }
-  if (ch == '\b') {
-    return '\b';
-  }
 
   return char(ch);
 }
 
-Lexeme lexChar(std::istream &source) {
-  const int ch = source.get();
+Lexeme Lexer::lexChar() {
+  const int ch = get();
 
   if (ch == EOF) {
     std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected EOF\n";
@@ -65,12 +67,12 @@ Lexeme lexChar(std::istream &source) {
   char value;
 
   if (ch == '\\') {
-    value = lexEscape(source);
+    value = lexEscape();
   } else {
     value = char(ch);
   }
 
-  if (source.get() != '\'') {
+  if (get() != '\'') {
     std::cerr << __FILE__ << ":" << __LINE__ << ": expected single-quote\n";
     exit(EXIT_FAILURE);
   }
@@ -78,173 +80,180 @@ Lexeme lexChar(std::istream &source) {
   return Lexeme{Lexeme::Type::Number, value};
 }
 
-Lexeme lexStr(std::istream &source, std::string &str) {
-  const int ch = source.get();
-
-  if (ch == EOF) {
-    std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected EOF\n";
-    exit(EXIT_FAILURE);
+Lexeme Lexer::lexStr() {
+  if (!stream) {
+    const std::size_t end = buffer.find_first_of("\"\\", position);
+    if (end != std::string_view::npos && buffer[end] == '\"') {
+      const std::string_view str = buffer.substr(position, end - position);
+      position = end + 1;
+      return Lexeme{Lexeme::Type::String, str};
+    }
   }
 
-  if (ch == '\"') {
-    return Lexeme{Lexeme::Type::String, str};
-  }
-
-  char value;
-
-  if (ch == '\\') {
-    value = lexEscape(source);
-  } else {
-    value = char(ch);
-  }
-
-  str.push_back(value);
+  scratch.clear();
+  while (true) {
+    const int ch = get();
 
-  return lexStr(source, str);
-}
+    if (ch == EOF) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected EOF\n";
+      exit(EXIT_FAILURE);
+    }
 
-Lexeme lexNum(std::istream &source, std::string &word, std::int64_t sign,
-              std::int64_t mag) {
-  const int ch = source.get();
+    if (ch == '\"') {
+      return Lexeme{Lexeme::Type::String, std::string_view(scratch)};
+    }
 
-  if (isSpace(ch)) {
-    return Lexeme{Lexeme::Type::Number, sign * mag};
+    if (ch == '\\') {
+      scratch.push_back(lexEscape());
+    } else {
+      scratch.push_back(char(ch));
+    }
   }
-
-  word.push_back(char(ch));
-
-  if (isDec(ch)) {
-    const std::int64_t TEN = 10;
-    mag *= TEN;
-    mag += toDec(ch);
-    return lexNum(source, word, sign, mag);
-  }
-
-  return lexWord(source, word);
 }
 
-Lexeme lexSign(std::istream &source, std::string &word, std::int64_t sign) {
-  const int ch = source.get();
-
-  if (isSpace(ch)) {
-    return lexWordDone(word);
+// Reads up to and including the space that ends the lexeme starting with
+// first.
+std::string_view Lexer::lexToken(int first) {
+  if (stream) {
+    scratch.assign(1, char(first));
+    for (int ch = stream->get(); !isSpace(ch); ch = stream->get()) {
+      scratch.push_back(char(ch));
+    }
+    return scratch;
   }
 
-  word.push_back(char(ch));
-
-  if (isDec(ch)) {
-    return lexNum(source, word, sign, toDec(ch));
+  const std::size_t start = position - 1;
+  while (position < buffer.size() &&
+         !isSpace(std::uint8_t(buffer[position]))) {
+    ++position;
   }
-
-  return lexWord(source, word);
+  const std::string_view token = buffer.substr(start, position - start);
+  if (position < buffer.size()) {
+    ++position;
+  }
+  return token;
 }
 
-Lexeme lexWordDone(const std::string &word) {
-  const std::map<std::string, Lexeme> BUILTIN_TABLE = {
-
-      {"+", {Lexeme::Type::Add, {}}},
-      {"-", {Lexeme::Type::Sub, {}}},
-      {"*", {Lexeme::Type::Mul, {}}},
-      {"/", {Lexeme::Type::Div, {}}},
-      {"rem", {Lexeme::Type::Rem, {}}},
-      {"mod", {Lexeme::Type::Mod, {}}},
-
-      {"<", {Lexeme::Type::Less, {}}},
-      {">", {Lexeme::Type::More, {}}},
-      {"=", {Lexeme::Type::Equal, {}}},
-      {"<>", {Lexeme::Type::NotEqual, {}}},
-
-      {"and", {Lexeme::Type::And, {}}},
-      {"or", {Lexeme::Type::Or, {}}},
-      {"invert", {Lexeme::Type::Invert, {}}},
-
-      {"emit", {Lexeme::Type::Emit, {}}},
-      {"key", {Lexeme::Type::Key, {}}},
-
-      {"dup", {Lexeme::Type::Dup, {}}},
-      {"drop", {Lexeme::Type::Drop, {}}},
-      {"swap", {Lexeme::Type::Swap, {}}},
-      {"over", {Lexeme::Type::Over, {}}},
-      {"rot", {Lexeme::Type::Rot, {}}},
-
-      {">r", {Lexeme::Type::ToR, {}}},
-      {"r>", {Lexeme::Type::RFrom, {}}},
-      {"r@", {Lexeme::Type::RFetch, {}}},
-
-      {"!", {Lexeme::Type::Store, {}}},
-      {"@", {Lexeme::Type::Fetch, {}}},
-      {"c!", {Lexeme::Type::CStore, {}}},
-      {"c@", {Lexeme::Type::CFetch, {}}},
-      {"alloc", {Lexeme::Type::Alloc, {}}},
-      {"free", {Lexeme::Type::Free, {}}},
-
-      {".s", {Lexeme::Type::DotS, {}}},
-      {"bye", {Lexeme::Type::Bye, {}}},
-
-      {":", {Lexeme::Type::Col, {}}},
-      {";", {Lexeme::Type::Semi, {}}},
-
-      {"if", {Lexeme::Type::If, {}}},
-      {"then", {Lexeme::Type::Then, {}}},
-      {"else", {Lexeme::Type::Else, {}}},
-
-      {"begin", {Lexeme::Type::Begin, {}}},
-      {"until", {Lexeme::Type::Until, {}}},
-      {"while", {Lexeme::Type::While, {}}},
-      {"repeat", {Lexeme::Type::Repeat, {}}},
-      {"again", {Lexeme::Type::Again, {}}},
-
-  };
+struct Builtin {
+  std::string_view word;
+  Lexeme::Type type;
+};
+
+// Sorted by word so that lexWordDone can binary search it.
+constexpr Builtin BUILTIN_TABLE[] = {
+    {"!", Lexeme::Type::Store},
+    {"*", Lexeme::Type::Mul},
+    {"+", Lexeme::Type::Add},
+    {"+loop", Lexeme::Type::PlusLoop},
+    {"-", Lexeme::Type::Sub},
+    {".s", Lexeme::Type::DotS},
+    {"/", Lexeme::Type::Div},
+    {":", Lexeme::Type::Col},
+    {";", Lexeme::Type::Semi},
+    {"<", Lexeme::Type::Less},
+    {"<>", Lexeme::Type::NotEqual},
+    {"=", Lexeme::Type::Equal},
+    {">", Lexeme::Type::More},
+    {">r", Lexeme::Type::ToR},
+    {"@", Lexeme::Type::Fetch},
+    {"accept", Lexeme::Type::Accept},
+    {"again", Lexeme::Type::Again},
+    {"alloc", Lexeme::Type::Alloc},
+    {"and", Lexeme::Type::And},
+    {"begin", Lexeme::Type::Begin},
+    {"bye", Lexeme::Type::Bye},
+    {"c!", Lexeme::Type::CStore},
+    {"c@", Lexeme::Type::CFetch},
+    {"compare", Lexeme::Type::Compare},
+    {"do", Lexeme::Type::Do},
+    {"drop", Lexeme::Type::Drop},
+    {"dup", Lexeme::Type::Dup},
+    {"else", Lexeme::Type::Else},
+    {"emit", Lexeme::Type::Emit},
+    {"fill", Lexeme::Type::Fill},
+    {"flush", Lexeme::Type::Flush},
+    {"free", Lexeme::Type::Free},
+    {"i", Lexeme::Type::I},
+    {"if", Lexeme::Type::If},
+    {"invert", Lexeme::Type::Invert},
+    {"j", Lexeme::Type::J},
+    {"key", Lexeme::Type::Key},
+    {"leave", Lexeme::Type::Leave},
+    {"loop", Lexeme::Type::Loop},
+    {"mod", Lexeme::Type::Mod},
+    {"move", Lexeme::Type::Move},
+    {"or", Lexeme::Type::Or},
+    {"over", Lexeme::Type::Over},
+    {"r>", Lexeme::Type::RFrom},
+    {"r@", Lexeme::Type::RFetch},
+    {"read-line", Lexeme::Type::ReadLine},
+    {"region-alloc", Lexeme::Type::RegionAlloc},
+    {"region-mark", Lexeme::Type::RegionMark},
+    {"region-release", Lexeme::Type::RegionRelease},
+    {"rem", Lexeme::Type::Rem},
+    {"repeat", Lexeme::Type::Repeat},
+    {"rot", Lexeme::Type::Rot},
+    {"scan", Lexeme::Type::Scan},
+    {"slurp", Lexeme::Type::Slurp},
+    {"strdup", Lexeme::Type::Strdup},
+    {"swap", Lexeme::Type::Swap},
+    {"then", Lexeme::Type::Then},
+    {"type", Lexeme::Type::Type},
+    {"until", Lexeme::Type::Until},
+    {"while", Lexeme::Type::While},
+};
+
+static_assert(std::is_sorted(std::begin(BUILTIN_TABLE),
+                             std::end(BUILTIN_TABLE),
+                             [](const Builtin &a, const Builtin &b) {
+                               return a.word < b.word;
+                             }));
+
+Lexeme lexWordDone(std::string_view word) {
+  const std::size_t sign = word[0] == '+' || word[0] == '-';
+  if (word.size() > sign &&
+      std::all_of(word.begin() + sign, word.end(), isDec)) {
+    std::uint64_t mag = 0;
+    for (const char ch : word.substr(sign)) {
+      mag = mag * 10 + std::uint64_t(toDec(ch));
+    }
+    return Lexeme{Lexeme::Type::Number,
+                  std::int64_t(word[0] == '-' ? -mag : mag)};
+  }
 
-  const auto &find = BUILTIN_TABLE.find(word);
-  if (find != BUILTIN_TABLE.end()) {
-    return find->second;
+  const Builtin *find = std::lower_bound(
+      std::begin(BUILTIN_TABLE), std::end(BUILTIN_TABLE), word,
+      [](const Builtin &builtin, std::string_view word) {
+        return builtin.word < word;
+      });
+  if (find != std::end(BUILTIN_TABLE) && find->word == word) {
+    return Lexeme{find->type, {}};
   }
 
   return Lexeme{Lexeme::Type::Word, word};
 }
 
-Lexeme lexWord(std::istream &source, std::string &word) {
-  const int ch = source.get();
-
-  if (isSpace(ch)) {
-    return lexWordDone(word);
+std::optional<Lexeme> Lexer::lex() {
+  if (!stream) {
+    while (position < buffer.size() &&
+           isSpace(std::uint8_t(buffer[position]))) {
+      ++position;
+    }
   }
 
-  word.push_back(char(ch));
-  return lexWord(source, word);
-}
-
-std::optional<Lexeme> lex(std::istream &source) {
-  const int ch = source.get();
-  if (ch == EOF) {
-    return {};
-  }
-  if (isSpace(ch)) {
-    return lex(source);
-  }
-  return lexChar(ch, source);
-}
+  int ch;
+  do {
+    ch = get();
+    if (ch == EOF) {
+      return {};
+    }
+  } while (isSpace(ch));
 
-Lexeme lexChar(int ch, std::istream &source) {
   if (ch == '\'') {
-    return lexChar(source);
+    return lexChar();
   }
   if (ch == '\"') {
-    std::string str;
-    return lexStr(source, str);
-  }
-
-  std::string word;
-  word.push_back(char(ch));
-  if (isDec(ch)) {
-    return lexNum(source, word, +1, toDec(ch));
-  }
-  if (ch == '+') {
-    return lexSign(source, word, +1);
-  }
-  if (ch == '-') {
-    return lexSign(source, word, -1);
+    return lexStr();
   }
-  return lexWord(source, word);
+  return lexWordDone(lexToken(ch));
 }
@@ -1,10 +1,12 @@
 #ifndef LEXER_HH
 #define LEXER_HH
 
+#include <cstddef>
 #include <cstdint>
 #include <iostream>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <variant>
 
 struct Lexeme {
@@ -31,6 +33,11 @@ struct Lexeme {
 
     Emit,
     Key,
+    Type,
+    Flush,
+    Accept,
+    ReadLine,
+    Slurp,
 
     Dup,
     Drop,
@@ -41,6 +48,8 @@ struct Lexeme {
     ToR,
     RFrom,
     RFetch,
+    I,
+    J,
 
     Store,
     Fetch,
@@ -48,6 +57,14 @@ struct Lexeme {
     CFetch,
     Alloc,
     Free,
+    RegionAlloc,
+    RegionMark,
+    RegionRelease,
+    Strdup,
+    Move,
+    Fill,
+    Compare,
+    Scan,
 
     DotS,
     Bye,
@@ -64,10 +81,38 @@ struct Lexeme {
     While,
     Repeat,
     Again,
+
+    Do,
+    Loop,
+    PlusLoop,
+    Leave,
   } type;
-  std::variant<std::monostate, std::int64_t, std::string> data;
+  // String and Word text stays valid only until the next call to Lexer::lex.
+  std::variant<std::monostate, std::int64_t, std::string_view> data;
 };
 
-std::optional<Lexeme> lex(std::istream &source);
+// Splits source text into lexemes. A buffer is scanned in place and must
+// outlive the lexer; a stream is read one character at a time and never past
+// the end of the current lexeme, so a program can go on reading it with key.
+class Lexer {
+private:
+  std::istream *stream = nullptr;
+  std::string_view buffer;
+  std::size_t position = 0;
+  // Text of the current lexeme when it cannot be a slice of buffer.
+  std::string scratch;
+
+  int get();
+  char lexEscape();
+  Lexeme lexChar();
+  Lexeme lexStr();
+  std::string_view lexToken(int first);
+
+public:
+  explicit Lexer(std::istream &source);
+  explicit Lexer(std::string_view source);
+
+  std::optional<Lexeme> lex();
+};
 
 #endif // LEXER_HH
@@ -1,37 +1,87 @@
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <optional>
+#include <string>
+#include <unistd.h>
+#include <vector>
 
+#include "build.hh"
 #include "compiler.hh"
 #include "engine.hh"
+#include "file.hh"
+#include "hash.hh"
+#include "lexer.hh"
 
-Engine engine;
-Compiler compiler;
+std::optional<Engine> engine;
+std::optional<Compiler> compiler;
 
 bool evalFile(const std::filesystem::path &path) {
-  std::ifstream file{path};
-  if (!file.is_open()) {
+  const MappedFile file{path};
+  if (!file.isOpen()) {
     std::cerr << __FILE__ << ":" << __LINE__ << path
               << ": : No such file or directory\n";
     exit(EXIT_FAILURE);
   }
-  const bool flag = engine.eval(file);
-  file.close();
-  return flag;
+  Lexer lexer{file.contents()};
+  return engine->eval(lexer);
+}
+
+std::uint64_t hashFile(const std::filesystem::path &path) {
+  const MappedFile file{path};
+  if (!file.isOpen()) {
+    std::cerr << __FILE__ << ":" << __LINE__ << path
+              << ": : No such file or directory\n";
+    exit(EXIT_FAILURE);
+  }
+  return fnv1a(file.contents());
+}
+
+// Loads the image at path if there is one and it was made from a source
+// hashing to sourceHash.
+bool loadImage(const std::filesystem::path &path, std::uint64_t sourceHash) {
+  const MappedFile file{path};
+  return file.isOpen() && engine->readImage(file.contents(), sourceHash);
+}
+
+// Reports a store into a string literal, which faults because the literals
+// are read-only. Any other fault is left to the default action.
+void reportLiteralStore(int, siginfo_t *info, void *) {
+  if (engine && engine->isLiteral(info->si_addr)) {
+    static constexpr char message[] =
+        __FILE__ ": store into a string literal\n";
+    write(STDERR_FILENO, message, sizeof(message) - 1);
+    _exit(EXIT_FAILURE);
+  }
+}
+
+// Holds back up to size bytes of output before writing to stdout, or writes
+// through if size is 0. Output is also flushed by flush, key and on exit,
+// after every destructor has run, so the buffer is never freed.
+void bufferOutput(std::size_t size) {
+  if (size == 0) {
+    std::setvbuf(stdout, nullptr, _IONBF, 0);
+    return;
+  }
+  static char *const buffer = new char[size];
+  std::setvbuf(stdout, buffer, _IOFBF, size);
 }
 
 void compileFile(const std::filesystem::path &path) {
-  std::ifstream file{path};
-  if (!file.is_open()) {
+  const MappedFile file{path};
+  if (!file.isOpen()) {
     std::cerr << __FILE__ << ":" << __LINE__ << path
               << ": : No such file or directory\n";
     exit(EXIT_FAILURE);
   }
 
-  compiler.compile(file);
-  file.close();
+  Lexer lexer{file.contents()};
+  compiler->compile(lexer);
 }
 
 int main(int argc, char **argv) {
@@ -39,29 +89,89 @@ int main(int argc, char **argv) {
   std::filesystem::path corePath = selfPath;
   corePath.replace_filename("core.forth");
 
-  if (argc < 3) {
-    std::cout << "usage: " << argv[0] << " (comp|interp) <files>" << std::endl;
+  Engine::Options engineOptions;
+  Compiler::Options compilerOptions;
+  std::size_t outputBuffer = std::size_t(1) << 16;
+
+  int argi = 1;
+  for (; argi < argc && std::strncmp(argv[argi], "--", 2) == 0; ++argi) {
+    const std::string option = argv[argi];
+    if (option == "--tree") {
+      engineOptions.treeWalker = true;
+    } else if (option == "--no-inline") {
+      engineOptions.inlining = false;
+      compilerOptions.inlining = false;
+    } else if (option == "--stack-size" && argi + 1 < argc) {
+      char *end;
+      const unsigned long long size = std::strtoull(argv[++argi], &end, 10);
+      if (*end != '\0' || size == 0) {
+        std::cerr << "expected positive stack size\n";
+        exit(EXIT_FAILURE);
+      }
+      engineOptions.stackSize = size;
+      compilerOptions.stackSize = size;
+    } else if (option == "--jit-threshold" && argi + 1 < argc) {
+      char *end;
+      const unsigned long calls = std::strtoul(argv[++argi], &end, 10);
+      if (*end != '\0' || calls > UINT32_MAX) {
+        std::cerr << "expected call count\n";
+        exit(EXIT_FAILURE);
+      }
+      engineOptions.jitThreshold = std::uint32_t(calls);
+    } else if (option == "--output-buffer" && argi + 1 < argc) {
+      char *end;
+      const unsigned long long size = std::strtoull(argv[++argi], &end, 10);
+      if (*end != '\0') {
+        std::cerr << "expected output buffer size\n";
+        exit(EXIT_FAILURE);
+      }
+      outputBuffer = size;
+      compilerOptions.outputBuffer = size;
+    } else {
+      std::cerr << "unknown option " << option << "\n";
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (argc - argi < 2) {
+    std::cout << "usage: " << argv[0] << " [--tree] [--no-inline]"
+              << " [--stack-size <cells>]"
+              << " [--jit-threshold <calls>] [--output-buffer <bytes>]"
+              << " (comp|build|run-compiled|interp|image) <files>"
+              << std::endl;
     exit(EXIT_FAILURE);
   }
 
-  const std::string command = argv[1];
-  const std::filesystem::path sourcePath{argv[2]};
+  const std::string command = argv[argi];
+  const std::filesystem::path sourcePath{argv[argi + 1]};
+  bufferOutput(outputBuffer);
 
   if (command == "interp") {
     std::vector<const char *> args;
-    args.reserve(argc - 2);
-    for (int i = 2; i < argc; ++i) {
+    args.reserve(argc - argi - 1);
+    for (int i = argi + 1; i < argc; ++i) {
       args.push_back(argv[i]);
     }
 
-    evalFile(corePath);
+    engine.emplace(engineOptions);
+    struct sigaction action = {};
+    action.sa_sigaction = reportLiteralStore;
+    action.sa_flags = SA_SIGINFO | SA_RESETHAND;
+    sigaction(SIGSEGV, &action, nullptr);
+    std::filesystem::path imagePath = corePath;
+    imagePath.replace_extension(".img");
+    if (!loadImage(imagePath, hashFile(corePath))) {
+      evalFile(corePath);
+    }
 
-    engine.pushArgs(args);
+    engine->pushArgs(args);
     const bool flag = evalFile(sourcePath);
     if (flag) {
-      engine.eval(std::cin);
+      Lexer lexer{std::cin};
+      engine->eval(lexer);
     }
   } else if (command == "comp") {
+    compiler.emplace(compilerOptions);
     compileFile(corePath);
     compileFile(sourcePath);
 
@@ -69,10 +179,46 @@ int main(int argc, char **argv) {
     destinationPath.concat(".cc");
 
     std::ofstream destination(destinationPath);
-    compiler.write(destination);
+    compiler->write(destination);
+    destination.close();
+  } else if (command == "image") {
+    engine.emplace(engineOptions);
+    evalFile(sourcePath);
+
+    std::filesystem::path destinationPath = sourcePath;
+    destinationPath.replace_extension(".img");
+    if (argc - argi >= 4 && std::strcmp(argv[argi + 2], "-o") == 0) {
+      destinationPath = argv[argi + 3];
+    }
+
+    std::ofstream destination(destinationPath, std::ios::binary);
+    engine->writeImage(destination, hashFile(sourcePath));
     destination.close();
+  } else if (command == "build") {
+    const std::filesystem::path binaryPath =
+        build(corePath, sourcePath, compilerOptions);
+
+    std::filesystem::path destinationPath = sourcePath;
+    destinationPath.replace_extension();
+    if (destinationPath == sourcePath) {
+      destinationPath.concat(".out");
+    }
+    std::filesystem::copy_file(
+        binaryPath, destinationPath,
+        std::filesystem::copy_options::overwrite_existing);
+  } else if (command == "run-compiled") {
+    const std::filesystem::path binaryPath =
+        build(corePath, sourcePath, compilerOptions);
+
+    // Like interp, the program sees its source path as its first argument.
+    std::vector<char *> args(argv + argi + 1, argv + argc);
+    args.push_back(nullptr);
+    execv(binaryPath.c_str(), args.data());
+    std::cerr << __FILE__ << ":" << __LINE__ << ": cannot run " << binaryPath
+              << "\n";
+    exit(EXIT_FAILURE);
   } else {
-    std::cerr << "unknown command " << argv[1] << "\n";
+    std::cerr << "unknown command " << command << "\n";
   }
 
   exit(EXIT_SUCCESS);
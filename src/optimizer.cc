@@ -0,0 +1,281 @@
+#include "optimizer.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "parser.hh"
+
+bool combine(Expression &first, const Expression &second);
+std::size_t bodySize(const std::vector<Expression> &body);
+bool unsafeToInline(const std::vector<Expression> &body);
+bool unsafeToInline(const Expression &expression);
+bool inlinable(const std::vector<Expression> &body);
+
+// The pairs below are the most frequent ones in core.forth and the programs
+// under test/ and bench/.
+bool combine(Expression &first, const Expression &second) {
+  switch (first.type) {
+  case Expression::Type::Number: {
+    const std::int64_t number = std::get<std::int64_t>(first.data);
+    switch (second.type) {
+    case Expression::Type::Add:
+      first.type = Expression::Type::AddLit;
+      return true;
+    case Expression::Type::Sub:
+      if (number == std::numeric_limits<std::int64_t>::min()) {
+        return false;
+      }
+      first = Expression{Expression::Type::AddLit, -number};
+      return true;
+    case Expression::Type::More:
+      first.type = Expression::Type::MoreLit;
+      return true;
+    case Expression::Type::Less:
+      first.type = Expression::Type::LessLit;
+      return true;
+    case Expression::Type::Equal:
+      first.type = Expression::Type::EqualLit;
+      return true;
+    case Expression::Type::NotEqual:
+      first.type = Expression::Type::NotEqualLit;
+      return true;
+    default:
+      return false;
+    }
+  }
+  case Expression::Type::AddLit:
+    if (second.type == Expression::Type::AddLit) {
+      const std::uint64_t sum =
+          std::uint64_t(std::get<std::int64_t>(first.data)) +
+          std::uint64_t(std::get<std::int64_t>(second.data));
+      first.data = std::int64_t(sum);
+      return true;
+    }
+    return false;
+  case Expression::Type::Over:
+    if (second.type == Expression::Type::Over) {
+      first.type = Expression::Type::TwoDup;
+      return true;
+    }
+    return false;
+  case Expression::Type::Drop:
+    if (second.type == Expression::Type::Drop) {
+      first.type = Expression::Type::TwoDrop;
+      return true;
+    }
+    return false;
+  case Expression::Type::Swap:
+    if (second.type == Expression::Type::Drop) {
+      first.type = Expression::Type::Nip;
+      return true;
+    }
+    return false;
+  case Expression::Type::Rot:
+    if (second.type == Expression::Type::Rot) {
+      first.type = Expression::Type::MinusRot;
+      return true;
+    }
+    return false;
+  default:
+    return false;
+  }
+}
+
+void fuse(std::vector<Expression> &body) {
+  std::vector<Expression> fused;
+  fused.reserve(body.size());
+  for (Expression &expression : body) {
+    fuse(expression);
+    fused.push_back(std::move(expression));
+    while (fused.size() >= 2 &&
+           combine(fused[fused.size() - 2], fused.back())) {
+      fused.pop_back();
+    }
+  }
+  body = std::move(fused);
+}
+
+void fuse(Expression &expression) {
+  switch (expression.type) {
+  case Expression::Type::WordDefinition:
+    fuse(std::get<Expression::WordDefinition>(expression.data).body);
+    break;
+  case Expression::Type::IfThen:
+  case Expression::Type::BeginUntil:
+  case Expression::Type::BeginAgain:
+  case Expression::Type::DoLoop:
+  case Expression::Type::DoPlusLoop:
+    fuse(std::get<std::vector<Expression>>(expression.data));
+    break;
+  case Expression::Type::IfElseThen: {
+    Expression::IfElse &ifElse = std::get<Expression::IfElse>(expression.data);
+    fuse(ifElse.ifBody);
+    fuse(ifElse.elseBody);
+  } break;
+  case Expression::Type::BeginWhileRepeat: {
+    Expression::BeginWhile &beginWhile =
+        std::get<Expression::BeginWhile>(expression.data);
+    fuse(beginWhile.condBody);
+    fuse(beginWhile.whileBody);
+  } break;
+  default:
+    break;
+  }
+}
+
+std::size_t bodySize(const std::vector<Expression> &body) {
+  std::size_t size = 0;
+  for (const Expression &expression : body) {
+    ++size;
+    switch (expression.type) {
+    case Expression::Type::IfThen:
+    case Expression::Type::BeginUntil:
+    case Expression::Type::BeginAgain:
+    case Expression::Type::DoLoop:
+    case Expression::Type::DoPlusLoop:
+      size += bodySize(std::get<std::vector<Expression>>(expression.data));
+      break;
+    case Expression::Type::IfElseThen: {
+      const Expression::IfElse &ifElse =
+          std::get<Expression::IfElse>(expression.data);
+      size += bodySize(ifElse.ifBody) + bodySize(ifElse.elseBody);
+    } break;
+    case Expression::Type::BeginWhileRepeat: {
+      const Expression::BeginWhile &beginWhile =
+          std::get<Expression::BeginWhile>(expression.data);
+      size += bodySize(beginWhile.condBody) + bodySize(beginWhile.whileBody);
+    } break;
+    default:
+      break;
+    }
+  }
+  return size;
+}
+
+// Whether splicing body into a caller could change what it does: it touches
+// the return stack, or it defines a word, which must happen only once.
+bool unsafeToInline(const std::vector<Expression> &body) {
+  for (const Expression &expression : body) {
+    if (unsafeToInline(expression)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool unsafeToInline(const Expression &expression) {
+  switch (expression.type) {
+  case Expression::Type::ToR:
+  case Expression::Type::RFrom:
+  case Expression::Type::RFetch:
+  case Expression::Type::WordDefinition:
+    return true;
+  case Expression::Type::IfThen:
+  case Expression::Type::BeginUntil:
+  case Expression::Type::BeginAgain:
+  case Expression::Type::DoLoop:
+  case Expression::Type::DoPlusLoop:
+    return unsafeToInline(std::get<std::vector<Expression>>(expression.data));
+  case Expression::Type::IfElseThen: {
+    const Expression::IfElse &ifElse =
+        std::get<Expression::IfElse>(expression.data);
+    return unsafeToInline(ifElse.ifBody) || unsafeToInline(ifElse.elseBody);
+  }
+  case Expression::Type::BeginWhileRepeat: {
+    const Expression::BeginWhile &beginWhile =
+        std::get<Expression::BeginWhile>(expression.data);
+    return unsafeToInline(beginWhile.condBody) ||
+           unsafeToInline(beginWhile.whileBody);
+  }
+  default:
+    return false;
+  }
+}
+
+// A word is spliced only if it is short, defines no words and, once spliced,
+// cannot observe or disturb its caller's return stack: any >r at its top level
+// is matched by an r> before it ends, and nested bodies do not touch the
+// return stack at all.
+bool inlinable(const std::vector<Expression> &body) {
+  const std::size_t INLINE_THRESHOLD = 8;
+  if (bodySize(body) > INLINE_THRESHOLD) {
+    return false;
+  }
+
+  std::size_t depth = 0;
+  for (const Expression &expression : body) {
+    switch (expression.type) {
+    case Expression::Type::ToR:
+      ++depth;
+      break;
+    case Expression::Type::RFrom:
+      if (depth == 0) {
+        return false;
+      }
+      --depth;
+      break;
+    case Expression::Type::RFetch:
+      if (depth == 0) {
+        return false;
+      }
+      break;
+    default:
+      if (unsafeToInline(expression)) {
+        return false;
+      }
+      break;
+    }
+  }
+  return depth == 0;
+}
+
+void inlineCalls(std::vector<Expression> &body, const Lookup &lookup) {
+  std::vector<Expression> inlined;
+  inlined.reserve(body.size());
+  for (Expression &expression : body) {
+    if (expression.type == Expression::Type::Word) {
+      const std::vector<Expression> *callee =
+          lookup(std::get<std::string>(expression.data));
+      if (callee != nullptr && inlinable(*callee)) {
+        inlined.insert(inlined.end(), callee->begin(), callee->end());
+        continue;
+      }
+    }
+    inlineCalls(expression, lookup);
+    inlined.push_back(std::move(expression));
+  }
+  body = std::move(inlined);
+}
+
+void inlineCalls(Expression &expression, const Lookup &lookup) {
+  switch (expression.type) {
+  case Expression::Type::WordDefinition:
+    inlineCalls(std::get<Expression::WordDefinition>(expression.data).body,
+                lookup);
+    break;
+  case Expression::Type::IfThen:
+  case Expression::Type::BeginUntil:
+  case Expression::Type::BeginAgain:
+  case Expression::Type::DoLoop:
+  case Expression::Type::DoPlusLoop:
+    inlineCalls(std::get<std::vector<Expression>>(expression.data), lookup);
+    break;
+  case Expression::Type::IfElseThen: {
+    Expression::IfElse &ifElse = std::get<Expression::IfElse>(expression.data);
+    inlineCalls(ifElse.ifBody, lookup);
+    inlineCalls(ifElse.elseBody, lookup);
+  } break;
+  case Expression::Type::BeginWhileRepeat: {
+    Expression::BeginWhile &beginWhile =
+        std::get<Expression::BeginWhile>(expression.data);
+    inlineCalls(beginWhile.condBody, lookup);
+    inlineCalls(beginWhile.whileBody, lookup);
+  } break;
+  default:
+    break;
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef OPTIMIZER_HH
+#define OPTIMIZER_HH
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "parser.hh"
+
+// Rewrites common primitive sequences into superinstructions, e.g. `1 +` into
+// AddLit and `over over` into TwoDup.
+void fuse(std::vector<Expression> &body);
+void fuse(Expression &expression);
+
+// Finds the body of an already-defined word, or returns nullptr.
+using Lookup =
+    std::function<const std::vector<Expression> *(const std::string &word)>;
+
+// Replaces calls to short words with a copy of their body. Callees are looked
+// up as they are defined at this point, so a word is never spliced into its
+// own definition.
+void inlineCalls(std::vector<Expression> &body, const Lookup &lookup);
+void inlineCalls(Expression &expression, const Lookup &lookup);
+
+#endif // OPTIMIZER_HH
@@ -1,31 +1,44 @@
 #include "parser.hh"
 
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <optional>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include "lexer.hh"
 
-Expression parseDefinitionWord(std::istream &source);
-Expression parseDefinitionBody(std::istream &source, const std::string &word,
-                               std::vector<Expression> &body);
-Expression parseIf(std::istream &source, std::vector<Expression> &body);
-Expression parseIfElse(std::istream &source,
-                       const std::vector<Expression> &ifBody,
-                       std::vector<Expression> &body);
-Expression parseBegin(std::istream &source, std::vector<Expression> &body);
-Expression parseBeginWhile(std::istream &source,
-                           const std::vector<Expression> &cond,
-                           std::vector<Expression> &body);
-Expression parseVariable(std::istream &source);
-std::vector<Expression> parseAll(std::istream &source);
-Expression parseLexeme(const Lexeme &lexeme, std::istream &source);
-Lexeme lexNoEOF(std::istream &source);
-
-Lexeme lexNoEOF(std::istream &source) {
-  std::optional<Lexeme> result = lex(source);
+// A control structure or definition whose end has not been reached yet.
+// Blocks are kept on an explicit stack so that neither long bodies nor deep
+// nesting use native stack.
+struct Block {
+  enum class Kind {
+    Definition,
+    If,
+    Else,
+    Begin,
+    While,
+    Do,
+  } kind;
+  std::string word;
+  std::vector<Expression> first;
+  std::vector<Expression> body;
+};
+
+std::vector<Expression> parseAll(Lexer &source);
+std::optional<Expression> parseLexeme(const Lexeme &lexeme, Lexer &source,
+                                      std::vector<Block> &blocks);
+std::optional<Expression> closeBlock(std::vector<Block> &blocks,
+                                     Expression::Type type);
+bool inBlock(const std::vector<Block> &blocks, Block::Kind kind);
+std::size_t countBlocks(const std::vector<Block> &blocks, Block::Kind kind);
+Lexeme lexNoEOF(Lexer &source);
+
+Lexeme lexNoEOF(Lexer &source) {
+  std::optional<Lexeme> result = source.lex();
   if (result) {
     return *result;
   }
@@ -34,155 +47,76 @@ Lexeme lexNoEOF(std::istream &source) {
   exit(EXIT_FAILURE);
 }
 
-std::vector<Expression> parseAll(std::istream &source) {
+std::vector<Expression> parseAll(Lexer &source) {
   std::vector<Expression> body;
   std::optional<Expression> expr;
   while ((expr = parse(source))) {
-    body.push_back(*expr);
+    body.push_back(std::move(*expr));
   }
   return body;
 }
 
-Expression parseBeginWhile(std::istream &source,
-                           const std::vector<Expression> &cond,
-                           std::vector<Expression> &body) {
-  const Lexeme lexeme = lexNoEOF(source);
-
-  switch (lexeme.type) {
-  case Lexeme::Type::Repeat: {
-    return Expression{Expression::Type::BeginWhileRepeat,
-                      Expression::BeginWhile{cond, body}};
-  } break;
-  default: {
-    body.push_back(parseLexeme(lexeme, source));
-    return parseBeginWhile(source, cond, body);
-
-  } break;
-  }
-
-  std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected\n";
-  exit(EXIT_FAILURE);
+bool inBlock(const std::vector<Block> &blocks, Block::Kind kind) {
+  return !blocks.empty() && blocks.back().kind == kind;
 }
 
-Expression parseBegin(std::istream &source, std::vector<Expression> &body) {
-  const Lexeme lexeme = lexNoEOF(source);
-
-  switch (lexeme.type) {
-  case Lexeme::Type::Until: {
-    return Expression{Expression::Type::BeginUntil, body};
-  } break;
-  case Lexeme::Type::While: {
-    const std::vector<Expression> &condBody = body;
-    std::vector<Expression> whileBody;
-    return parseBeginWhile(source, condBody, whileBody);
-  } break;
-  case Lexeme::Type::Again: {
-    return Expression{Expression::Type::BeginAgain, body};
-  } break;
-  default:
-    body.push_back(parseLexeme(lexeme, source));
-    return parseBegin(source, body);
-    break;
+// i, j and leave refer to the do loops around them, so they are only
+// accepted inside enough of them. A definition runs wherever it is called,
+// so loops outside the nearest one do not count.
+std::size_t countBlocks(const std::vector<Block> &blocks, Block::Kind kind) {
+  std::size_t count = 0;
+  for (auto block = blocks.rbegin();
+       block != blocks.rend() && block->kind != Block::Kind::Definition;
+       ++block) {
+    if (block->kind == kind) {
+      ++count;
+    }
   }
-
-  std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected\n";
-  exit(EXIT_FAILURE);
+  return count;
 }
 
-Expression parseIfElse(std::istream &source,
-                       const std::vector<Expression> &ifBody,
-                       std::vector<Expression> &body) {
-  const Lexeme lexeme = lexNoEOF(source);
-
-  switch (lexeme.type) {
-  case Lexeme::Type::Then: {
-    return Expression{Expression::Type::IfElseThen,
-                      Expression::IfElse{ifBody, body}};
-  } break;
-  default: {
-    body.push_back(parseLexeme(lexeme, source));
-    return parseIfElse(source, ifBody, body);
-  } break;
-  }
-
-  std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected\n";
-  exit(EXIT_FAILURE);
-}
-
-Expression parseIf(std::istream &source, std::vector<Expression> &body) {
-  const Lexeme lexeme = lexNoEOF(source);
-
-  switch (lexeme.type) {
-  case Lexeme::Type::Then: {
-    return Expression{Expression::Type::IfThen, body};
-  } break;
-  case Lexeme::Type::Else: {
-    const std::vector<Expression> &ifBody = body;
-    std::vector<Expression> elseBody;
-    return parseIfElse(source, ifBody, elseBody);
-  }
-  default: {
-    body.push_back(parseLexeme(lexeme, source));
-    return parseIf(source, body);
-  } break;
-  }
-
-  std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected\n";
-  exit(EXIT_FAILURE);
-}
-
-Expression parseDefinitionBody(std::istream &source, const std::string &word,
-                               std::vector<Expression> &body) {
-  const Lexeme lexeme = lexNoEOF(source);
-
-  switch (lexeme.type) {
-  case Lexeme::Type::Semi: {
-    return Expression{Expression::Type::WordDefinition,
-                      Expression::WordDefinition{word, body}};
-  } break;
-  case Lexeme::Type::Col:
-    std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected col\n";
-    exit(EXIT_FAILURE);
-    break;
-  default: {
-    body.push_back(parseLexeme(lexeme, source));
-    return parseDefinitionBody(source, word, body);
-  } break;
-  }
-
-  std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected\n";
-  exit(EXIT_FAILURE);
-}
-
-Expression parseDefinitionWord(std::istream &source) {
-  const Lexeme lexeme = lexNoEOF(source);
-
-  switch (lexeme.type) {
-  case Lexeme::Type::Word: {
-    const std::string &word = std::get<std::string>(lexeme.data);
-    std::vector<Expression> body;
-    return parseDefinitionBody(source, word, body);
-  } break;
+std::optional<Expression> closeBlock(std::vector<Block> &blocks,
+                                     Expression::Type type) {
+  Block block = std::move(blocks.back());
+  blocks.pop_back();
+
+  switch (type) {
+  case Expression::Type::WordDefinition:
+    return Expression{type, Expression::WordDefinition{std::move(block.word),
+                                                       std::move(block.body)}};
+  case Expression::Type::IfElseThen:
+    return Expression{type, Expression::IfElse{std::move(block.first),
+                                               std::move(block.body)}};
+  case Expression::Type::BeginWhileRepeat:
+    return Expression{type, Expression::BeginWhile{std::move(block.first),
+                                                   std::move(block.body)}};
   default:
-    std::cerr << __FILE__ << ":" << __LINE__ << ": expected WORD\n";
-    exit(EXIT_FAILURE);
-    break;
+    return Expression{type, std::move(block.body)};
   }
-
-  std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected\n";
-  exit(EXIT_FAILURE);
 }
 
-std::optional<Expression> parse(std::istream &source) {
-  std::optional<Lexeme> lexeme = lex(source);
-  if (lexeme) {
-    return parseLexeme(*lexeme, source);
+std::optional<Expression> parse(Lexer &source) {
+  std::optional<Lexeme> lexeme = source.lex();
+  if (!lexeme) {
+    return {};
   }
 
-  return {};
+  std::vector<Block> blocks;
+  while (true) {
+    std::optional<Expression> expression =
+        parseLexeme(*lexeme, source, blocks);
+    if (expression) {
+      if (blocks.empty()) {
+        return expression;
+      }
+      blocks.back().body.push_back(std::move(*expression));
+    }
+    lexeme = lexNoEOF(source);
+  }
 }
 
-Expression parseLexeme(const Lexeme &lexeme, std::istream &source) {
+std::optional<Expression> parseLexeme(const Lexeme &lexeme, Lexer &source,
+                                      std::vector<Block> &blocks) {
   switch (lexeme.type) {
 
   case Lexeme::Type::Number:
@@ -190,10 +124,10 @@ Expression parseLexeme(const Lexeme &lexeme, std::istream &source) {
                       std::get<std::int64_t>(lexeme.data)};
   case Lexeme::Type::String:
     return Expression{Expression::Type::String,
-                      std::get<std::string>(lexeme.data)};
+                      std::string(std::get<std::string_view>(lexeme.data))};
   case Lexeme::Type::Word:
     return Expression{Expression::Type::Word,
-                      std::get<std::string>(lexeme.data)};
+                      std::string(std::get<std::string_view>(lexeme.data))};
 
   case Lexeme::Type::Add:
     return Expression{Expression::Type::Add, {}};
@@ -228,6 +162,16 @@ Expression parseLexeme(const Lexeme &lexeme, std::istream &source) {
     return Expression{Expression::Type::Emit, {}};
   case Lexeme::Type::Key:
     return Expression{Expression::Type::Key, {}};
+  case Lexeme::Type::Type:
+    return Expression{Expression::Type::Type, {}};
+  case Lexeme::Type::Flush:
+    return Expression{Expression::Type::Flush, {}};
+  case Lexeme::Type::Accept:
+    return Expression{Expression::Type::Accept, {}};
+  case Lexeme::Type::ReadLine:
+    return Expression{Expression::Type::ReadLine, {}};
+  case Lexeme::Type::Slurp:
+    return Expression{Expression::Type::Slurp, {}};
 
   case Lexeme::Type::Dup:
     return Expression{Expression::Type::Dup, {}};
@@ -246,6 +190,18 @@ Expression parseLexeme(const Lexeme &lexeme, std::istream &source) {
     return Expression{Expression::Type::RFrom, {}};
   case Lexeme::Type::RFetch:
     return Expression{Expression::Type::RFetch, {}};
+  case Lexeme::Type::I:
+    if (countBlocks(blocks, Block::Kind::Do) >= 1) {
+      return Expression{Expression::Type::I, {}};
+    }
+    std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected I\n";
+    exit(EXIT_FAILURE);
+  case Lexeme::Type::J:
+    if (countBlocks(blocks, Block::Kind::Do) >= 2) {
+      return Expression{Expression::Type::J, {}};
+    }
+    std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected J\n";
+    exit(EXIT_FAILURE);
 
   case Lexeme::Type::Store:
     return Expression{Expression::Type::Store, {}};
@@ -259,45 +215,127 @@ Expression parseLexeme(const Lexeme &lexeme, std::istream &source) {
     return Expression{Expression::Type::Alloc, {}};
   case Lexeme::Type::Free:
     return Expression{Expression::Type::Free, {}};
+  case Lexeme::Type::RegionAlloc:
+    return Expression{Expression::Type::RegionAlloc, {}};
+  case Lexeme::Type::RegionMark:
+    return Expression{Expression::Type::RegionMark, {}};
+  case Lexeme::Type::RegionRelease:
+    return Expression{Expression::Type::RegionRelease, {}};
+  case Lexeme::Type::Strdup:
+    return Expression{Expression::Type::Strdup, {}};
+  case Lexeme::Type::Move:
+    return Expression{Expression::Type::Move, {}};
+  case Lexeme::Type::Fill:
+    return Expression{Expression::Type::Fill, {}};
+  case Lexeme::Type::Compare:
+    return Expression{Expression::Type::Compare, {}};
+  case Lexeme::Type::Scan:
+    return Expression{Expression::Type::Scan, {}};
 
   case Lexeme::Type::DotS:
     return Expression{Expression::Type::DotS, {}};
   case Lexeme::Type::Bye:
     return Expression{Expression::Type::Bye, {}};
 
-  case Lexeme::Type::Col:
-    return parseDefinitionWord(source);
+  case Lexeme::Type::Col: {
+    if (inBlock(blocks, Block::Kind::Definition)) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected col\n";
+      exit(EXIT_FAILURE);
+    }
+    const Lexeme word = lexNoEOF(source);
+    if (word.type != Lexeme::Type::Word) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ": expected WORD\n";
+      exit(EXIT_FAILURE);
+    }
+    blocks.push_back(Block{Block::Kind::Definition,
+                           std::string(std::get<std::string_view>(word.data)),
+                           {},
+                           {}});
+    return {};
+  }
   case Lexeme::Type::Semi:
+    if (inBlock(blocks, Block::Kind::Definition)) {
+      return closeBlock(blocks, Expression::Type::WordDefinition);
+    }
     std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected semicolon\n";
     exit(EXIT_FAILURE);
 
-  case Lexeme::Type::If: {
-    std::vector<Expression> lexemes;
-    return parseIf(source, lexemes);
-  }
+  case Lexeme::Type::If:
+    blocks.push_back(Block{Block::Kind::If, {}, {}, {}});
+    return {};
   case Lexeme::Type::Then:
+    if (inBlock(blocks, Block::Kind::If)) {
+      return closeBlock(blocks, Expression::Type::IfThen);
+    }
+    if (inBlock(blocks, Block::Kind::Else)) {
+      return closeBlock(blocks, Expression::Type::IfElseThen);
+    }
     std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected THEN\n";
     exit(EXIT_FAILURE);
   case Lexeme::Type::Else:
+    if (inBlock(blocks, Block::Kind::If)) {
+      Block &block = blocks.back();
+      block.kind = Block::Kind::Else;
+      block.first = std::move(block.body);
+      block.body.clear();
+      return {};
+    }
     std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected ELSE\n";
     exit(EXIT_FAILURE);
 
-  case Lexeme::Type::Begin: {
-    std::vector<Expression> lexemes;
-    return parseBegin(source, lexemes);
-  }
+  case Lexeme::Type::Begin:
+    blocks.push_back(Block{Block::Kind::Begin, {}, {}, {}});
+    return {};
   case Lexeme::Type::Until:
+    if (inBlock(blocks, Block::Kind::Begin)) {
+      return closeBlock(blocks, Expression::Type::BeginUntil);
+    }
     std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected UNTIL\n";
     exit(EXIT_FAILURE);
   case Lexeme::Type::While:
+    if (inBlock(blocks, Block::Kind::Begin)) {
+      Block &block = blocks.back();
+      block.kind = Block::Kind::While;
+      block.first = std::move(block.body);
+      block.body.clear();
+      return {};
+    }
     std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected WHILE\n";
     exit(EXIT_FAILURE);
   case Lexeme::Type::Repeat:
+    if (inBlock(blocks, Block::Kind::While)) {
+      return closeBlock(blocks, Expression::Type::BeginWhileRepeat);
+    }
     std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected REPEAT\n";
     exit(EXIT_FAILURE);
   case Lexeme::Type::Again:
+    if (inBlock(blocks, Block::Kind::Begin)) {
+      return closeBlock(blocks, Expression::Type::BeginAgain);
+    }
     std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected AGAIN\n";
     exit(EXIT_FAILURE);
+
+  case Lexeme::Type::Do:
+    blocks.push_back(Block{Block::Kind::Do, {}, {}, {}});
+    return {};
+  case Lexeme::Type::Loop:
+    if (inBlock(blocks, Block::Kind::Do)) {
+      return closeBlock(blocks, Expression::Type::DoLoop);
+    }
+    std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected LOOP\n";
+    exit(EXIT_FAILURE);
+  case Lexeme::Type::PlusLoop:
+    if (inBlock(blocks, Block::Kind::Do)) {
+      return closeBlock(blocks, Expression::Type::DoPlusLoop);
+    }
+    std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected +LOOP\n";
+    exit(EXIT_FAILURE);
+  case Lexeme::Type::Leave:
+    if (countBlocks(blocks, Block::Kind::Do) >= 1) {
+      return Expression{Expression::Type::Leave, {}};
+    }
+    std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected LEAVE\n";
+    exit(EXIT_FAILURE);
   }
 
   std::cerr << __FILE__ << ":" << __LINE__ << ": unexpected\n";
@@ -34,6 +34,11 @@ struct Expression {
 
     Emit,
     Key,
+    Type,
+    Flush,
+    Accept,
+    ReadLine,
+    Slurp,
 
     Dup,
     Drop,
@@ -44,6 +49,8 @@ struct Expression {
     ToR,
     RFrom,
     RFetch,
+    I,
+    J,
 
     Store,
     Fetch,
@@ -51,10 +58,28 @@ struct Expression {
     CFetch,
     Alloc,
     Free,
+    RegionAlloc,
+    RegionMark,
+    RegionRelease,
+    Strdup,
+    Move,
+    Fill,
+    Compare,
+    Scan,
 
     DotS,
     Bye,
 
+    AddLit,
+    MoreLit,
+    LessLit,
+    EqualLit,
+    NotEqualLit,
+    TwoDup,
+    TwoDrop,
+    Nip,
+    MinusRot,
+
     WordDefinition,
 
     IfThen,
@@ -63,6 +88,10 @@ struct Expression {
     BeginUntil,
     BeginWhileRepeat,
     BeginAgain,
+
+    DoLoop,
+    DoPlusLoop,
+    Leave,
   } type;
   struct WordDefinition {
     std::string word;
@@ -81,6 +110,6 @@ struct Expression {
       data;
 };
 
-std::optional<Expression> parse(std::istream &source);
+std::optional<Expression> parse(Lexer &source);
 
 #endif // PARSER_HH
@@ -0,0 +1,125 @@
+#!/bin/bash
+# Run every test/*.forth that has an expected test/*.out in each of the modes
+# below, feeding it test/*.in when there is one, and report each mode that
+# fails or whose output differs. Every test/fail/*.forth must instead be
+# rejected with an ordinary failure status in each mode, with the executable
+# built with STACKER_DEBUG so that it checks the stacks. The interpreter only
+# trips over the faults in test/fail/compiled/*.forth if it runs them, so
+# those must only be rejected when compiled. A core.img that is stale or
+# corrupt must be passed over for core.forth. Finally, the programs in
+# test/flush/ check that buffered output comes out before key waits for input,
+# on flush, and before an error message.
+
+cd "$(dirname "$0")/.."
+status=0
+# The interpreter, also compiling words to machine code never and from their
+# first call, the tree-walker and a compiled executable, with the interpreter
+# and the executable also run without inlining.
+modes=(interp "--jit-threshold 0 interp" "--jit-threshold 1 interp"
+       "--no-inline interp" "--tree interp" run-compiled
+       "--no-inline run-compiled")
+actual=$(mktemp)
+scratch=$(mktemp -d)
+trap 'rm -rf "$actual" "$scratch"' EXIT
+
+for expected in test/*.out; do
+  program=${expected%.out}.forth
+  input=${expected%.out}.in
+  [ -f "$input" ] || input=/dev/null
+
+  for mode in "${modes[@]}"; do
+    if ! ./stacker $mode "$program" <"$input" >"$actual"; then
+      echo "$program: $mode failed"
+      status=1
+    elif ! cmp -s "$actual" "$expected"; then
+      echo "$program: $mode output differs from $expected"
+      status=1
+    fi
+  done
+done
+
+for program in test/fail/*.forth; do
+  for mode in "${modes[@]}"; do
+    CXXFLAGS=-DSTACKER_DEBUG ./stacker $mode "$program" </dev/null \
+      >/dev/null 2>&1
+    code=$?
+    if [ $code -ne 1 ]; then
+      echo "$program: $mode exited with $code instead of being rejected"
+      status=1
+    fi
+  done
+done
+
+for program in test/fail/compiled/*.forth; do
+  ./stacker run-compiled "$program" </dev/null >/dev/null 2>&1
+  code=$?
+  if [ $code -ne 1 ]; then
+    echo "$program: run-compiled exited with $code instead of being rejected"
+    status=1
+  fi
+done
+
+# The stale image comes from a core.forth whose cr prints more than a newline.
+cp stacker "$scratch"
+sed "s/^: cr .*/: cr '!' emit '\\n' emit ;/" core.forth >"$scratch/core.forth"
+"$scratch/stacker" image "$scratch/core.forth"
+cp core.forth "$scratch"
+for corruption in stale truncated garbage; do
+  case $corruption in
+  truncated) head -c 100 core.img >"$scratch/core.img" ;;
+  garbage) yes stkimg01 | head -c 4096 >"$scratch/core.img" ;;
+  esac
+  if ! "$scratch/stacker" interp test/loop.forth </dev/null >"$actual"; then
+    echo "test/loop.forth: interp with a $corruption core.img failed"
+    status=1
+  elif ! cmp -s "$actual" test/loop.out; then
+    echo "test/loop.forth: interp with a $corruption core.img differs"
+    status=1
+  fi
+done
+
+# Waits long enough to build an executable for text to show up in file.
+waitFor() {
+  for _ in $(seq 600); do
+    grep -qF "$2" "$1" && return 0
+    sleep 0.1
+  done
+  return 1
+}
+
+# Input is held back on a pipe until the expected output shows up.
+mkfifo "$scratch/input"
+for mode in "${modes[@]}"; do
+  exec 3<>"$scratch/input"
+  ./stacker $mode test/flush/key.forth <"$scratch/input" >"$actual" 3>&- &
+  if ! waitFor "$actual" "? "; then
+    echo "test/flush/key.forth: $mode did not prompt before key"
+    status=1
+  fi
+  echo x >&3
+  exec 3>&-
+  if ! wait $! || [ "$(cat "$actual")" != "? x" ]; then
+    echo "test/flush/key.forth: $mode failed"
+    status=1
+  fi
+
+  ./stacker $mode test/flush/flush.forth "$scratch/input" >"$actual" &
+  if ! waitFor "$actual" "ready"; then
+    echo "test/flush/flush.forth: $mode did not write out on flush"
+    status=1
+  fi
+  echo x >"$scratch/input"
+  if ! wait $! || [ "$(cat "$actual")" != "ready x" ]; then
+    echo "test/flush/flush.forth: $mode failed"
+    status=1
+  fi
+
+  CXXFLAGS=-DSTACKER_DEBUG ./stacker $mode test/flush/error.forth </dev/null \
+    >"$actual" 2>&1
+  if [ "$(head -n 1 "$actual")" != before ]; then
+    echo "test/flush/error.forth: $mode wrote its output after the error"
+    status=1
+  fi
+done
+
+exit $status